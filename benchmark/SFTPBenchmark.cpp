@@ -0,0 +1,234 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Offline benchmark of the CPU side of directory listings: converting
+ * attributes to VFS entries, freeing them, correcting paths and hashing
+ * session identities. Synthetic attributes stand in for a server, so the
+ * numbers only change when the code does.
+ *
+ * Build with -DSFTP_BUILD_BENCHMARK=ON and run sftp-benchmark.
+ */
+
+#include "SFTPDirectory.h"
+#include "SFTPSession.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+static size_t allocations = 0;
+
+#ifdef __GLIBC__
+// Counting malloc catches strdup and operator new alike, glibc routes both through it
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+extern "C" void* malloc(size_t size) __THROW
+{
+  allocations++;
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) __THROW
+{
+  allocations++;
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) __THROW
+{
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+#define SFTP_COUNTS_ALLOCATIONS 1
+#else
+#define SFTP_COUNTS_ALLOCATIONS 0
+#endif
+
+static int64_t NowNs()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*!
+ \brief Measures a number of rounds over a listing of \e entries items.
+ */
+class CMeasurement
+{
+public:
+  CMeasurement(const char *name, size_t entries)
+    : m_name(name), m_entries(entries), m_rounds(0), m_ns(0), m_allocations(0) {}
+
+  void Start()
+  {
+    m_startAllocations = allocations;
+    m_start = NowNs();
+  }
+
+  void Stop()
+  {
+    m_ns += NowNs() - m_start;
+    m_allocations += allocations - m_startAllocations;
+    m_rounds++;
+  }
+
+  void Report() const
+  {
+    double perEntry = (double)m_rounds * m_entries;
+    if (SFTP_COUNTS_ALLOCATIONS)
+      printf("%-16s %8u entries %10.1f ns/entry %8.2f allocs/entry\n",
+             m_name, (unsigned int)m_entries, m_ns / perEntry, m_allocations / perEntry);
+    else
+      printf("%-16s %8u entries %10.1f ns/entry      n/a allocs/entry\n",
+             m_name, (unsigned int)m_entries, m_ns / perEntry);
+  }
+private:
+  const char *m_name;
+  size_t m_entries;
+  unsigned int m_rounds;
+  int64_t m_ns;
+  size_t m_allocations;
+  int64_t m_start;
+  size_t m_startAllocations;
+};
+
+/*!
+ \brief Builds a listing with a mix of media files, folders and hidden items.
+ */
+static void BuildListing(size_t entries, std::vector<struct sftp_attributes_struct>& listing)
+{
+  listing.resize(entries);
+  for (size_t i = 0; i < entries; i++)
+  {
+    char name[64];
+    struct sftp_attributes_struct& attributes = listing[i];
+    memset(&attributes, 0, sizeof(attributes));
+
+    if (i % 10 == 0)
+      snprintf(name, sizeof(name), ".hidden-%06u", (unsigned int)i);
+    else if (i % 8 == 0)
+      snprintf(name, sizeof(name), "Season %u", (unsigned int)i);
+    else
+      snprintf(name, sizeof(name), "Some.Show.S01E%06u.1080p.mkv", (unsigned int)i);
+
+    attributes.name = strdup(name);
+    attributes.type = i % 8 == 0 ? SSH_FILEXFER_TYPE_DIRECTORY : SSH_FILEXFER_TYPE_REGULAR;
+    attributes.size = (uint64_t)i * 1048576;
+    attributes.flags = SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_PERMISSIONS;
+  }
+}
+
+static void FreeListing(std::vector<struct sftp_attributes_struct>& listing)
+{
+  for (size_t i = 0; i < listing.size(); i++)
+    free(listing[i].name);
+  listing.clear();
+}
+
+static void Run(size_t entries)
+{
+  const std::string base = "sftp://user@media.example.org:22/";
+  const std::string folder = "~/Videos/Shows/";
+  const std::string options;
+  const unsigned int rounds = entries < 1000000 ? (unsigned int)(1000000 / entries) : 1;
+
+  std::vector<struct sftp_attributes_struct> listing;
+  BuildListing(entries, listing);
+
+  // Names arrive as strings from the metadata cache, so only the conversion itself is timed
+  std::vector<std::string> names(entries);
+  std::vector<std::string> paths(entries);
+  for (size_t i = 0; i < entries; i++)
+  {
+    names[i] = listing[i].name;
+    paths[i] = folder + names[i];
+  }
+
+  CMeasurement convert("ToDirEntry", entries);
+  CMeasurement release("FreeDirectory", entries);
+  CMeasurement correct("CorrectPath", entries);
+  CMeasurement identity("HashIdentity", entries);
+  size_t sink = 0;
+
+  for (unsigned int round = 0; round < rounds; round++)
+  {
+    // Like GetDirectory() the items are handed over in a vector Kodi owns
+    std::vector<VFSDirEntry>* items = new std::vector<VFSDirEntry>;
+    items->reserve(entries);
+
+    convert.Start();
+    for (size_t i = 0; i < entries; i++)
+    {
+      VFSDirEntry entry;
+      CSFTPDirectory::ToDirEntry(base, folder, names[i], options, &listing[i], entry);
+      items->push_back(entry);
+    }
+    convert.Stop();
+
+    release.Start();
+    CSFTPDirectory::FreeEntries(*items);
+    delete items;
+    release.Stop();
+
+    correct.Start();
+    for (size_t i = 0; i < entries; i++)
+      sink += CSFTPDirectory::CorrectPath(paths[i]).size();
+    correct.Stop();
+
+    VFSURL url;
+    memset(&url, 0, sizeof(url));
+    url.username = "user";
+    url.password = "secret";
+    url.port = 22;
+
+    identity.Start();
+    for (size_t i = 0; i < entries; i++)
+    {
+      url.hostname = listing[i].name;
+      sink += CSFTPSessionManager::HashIdentity(&url);
+    }
+    identity.Stop();
+  }
+
+  convert.Report();
+  release.Report();
+  correct.Report();
+  identity.Report();
+
+  // Keeps the compiler from dropping work whose result isn't otherwise used
+  if (sink == 0)
+    printf("\n");
+
+  FreeListing(listing);
+}
+
+int main()
+{
+  Run(1000);
+  Run(100000);
+
+  return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "SFTPBufferPool.h"
+#include "SFTPSession.h"
+
+// Total memory all sessions may use for buffers and caches, sized for 1 GB devices
+#define SFTP_MEMORY_BUDGET (32 * 1024 * 1024)
+
+CSFTPBufferPool& CSFTPBufferPool::Get()
+{
+  static CSFTPBufferPool instance;
+
+  return instance;
+}
+
+CSFTPBufferPool::CSFTPBufferPool()
+  : m_budget(SFTP_MEMORY_BUDGET),
+    m_used(0),
+    m_streams(0),
+    m_pressure(false)
+{
+  m_free.reserve(m_budget / SFTP_READ_CHUNK_SIZE);
+}
+
+CSFTPBufferPool::~CSFTPBufferPool()
+{
+  for (size_t i = 0; i < m_free.size(); i++)
+    delete[] m_free[i];
+}
+
+void CSFTPBufferPool::RegisterStream()
+{
+  PLATFORM::CLockObject lock(m_lock);
+  m_streams++;
+}
+
+void CSFTPBufferPool::UnregisterStream()
+{
+  PLATFORM::CLockObject lock(m_lock);
+  if (m_streams > 0)
+    m_streams--;
+}
+
+/*!
+ \brief Takes a slab of SFTP_READ_CHUNK_SIZE bytes from the pool.
+ \param force If \e true, the budget may be exceeded, used for data a caller is waiting on.
+ \return Returns the slab, or NULL if the budget is exhausted and \e force is \e false.
+ */
+char* CSFTPBufferPool::AcquireSlab(bool force)
+{
+  PLATFORM::CLockObject lock(m_lock);
+
+  // Recycled slabs are already accounted, handing one out doesn't change the total
+  if (!m_free.empty())
+  {
+    char* slab = m_free.back();
+    m_free.pop_back();
+    m_used += SFTP_READ_CHUNK_SIZE;
+    return slab;
+  }
+
+  if (m_used + SFTP_READ_CHUNK_SIZE > m_budget)
+  {
+    m_pressure = true;
+    if (!force)
+      return NULL;
+  }
+
+  m_used += SFTP_READ_CHUNK_SIZE;
+  return new char[SFTP_READ_CHUNK_SIZE];
+}
+
+void CSFTPBufferPool::ReleaseSlab(char* slab)
+{
+  if (!slab)
+    return;
+
+  PLATFORM::CLockObject lock(m_lock);
+  m_used -= SFTP_READ_CHUNK_SIZE;
+
+  // Slabs beyond the budget, or while others wait for memory, are not worth keeping around
+  if (m_pressure || GetCommitted() + SFTP_READ_CHUNK_SIZE > m_budget)
+    delete[] slab;
+  else
+    m_free.push_back(slab);
+
+  UpdatePressure();
+}
+
+/*!
+ \brief Accounts \e bytes of cache memory against the budget.
+ \return Returns \e false if they don't fit, the caller should not cache then.
+ */
+bool CSFTPBufferPool::Reserve(size_t bytes)
+{
+  PLATFORM::CLockObject lock(m_lock);
+
+  // Recycled slabs give way to the reservation
+  while (!m_free.empty() && GetCommitted() + bytes > m_budget)
+  {
+    delete[] m_free.back();
+    m_free.pop_back();
+  }
+
+  if (GetCommitted() + bytes > m_budget)
+  {
+    m_pressure = true;
+    return false;
+  }
+
+  m_used += bytes;
+  return true;
+}
+
+void CSFTPBufferPool::Unreserve(size_t bytes)
+{
+  PLATFORM::CLockObject lock(m_lock);
+  m_used -= bytes;
+  UpdatePressure();
+}
+
+/*!
+ \brief Returns how many bytes of read buffers a single stream may hold.
+ */
+size_t CSFTPBufferPool::GetFairShare()
+{
+  PLATFORM::CLockObject lock(m_lock);
+  return m_budget / (m_streams > 0 ? m_streams : 1);
+}
+
+bool CSFTPBufferPool::IsUnderPressure()
+{
+  PLATFORM::CLockObject lock(m_lock);
+  return m_pressure;
+}
+
+/*!
+ \brief Returns the memory counted against the budget, slabs in use, reservations and recycled slabs.
+ */
+size_t CSFTPBufferPool::GetCommitted() const
+{
+  return m_used + m_free.size() * SFTP_READ_CHUNK_SIZE;
+}
+
+void CSFTPBufferPool::UpdatePressure()
+{
+  // Stay under pressure until a quarter of the budget is free again to avoid flapping
+  if (m_pressure && m_used <= m_budget / 4 * 3)
+    m_pressure = false;
+}
@@ -0,0 +1,65 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "platform/threads/mutex.h"
+#include <stddef.h>
+#include <vector>
+
+/*!
+ \brief Process-wide memory budget for read buffers and caches of all sessions.
+
+ Read buffers are fixed size slabs of SFTP_READ_CHUNK_SIZE bytes that are
+ recycled instead of freed, so steady-state streaming doesn't allocate. Caches
+ reserve plain byte counts. Recycled slabs count against the budget as well and
+ are freed when a reservation needs their room. Every registered stream may use a fair share of the
+ budget for read-ahead; once the budget runs out the pool reports pressure and
+ streams above their share give memory back.
+ */
+class CSFTPBufferPool
+{
+public:
+  static CSFTPBufferPool& Get();
+
+  void RegisterStream();
+  void UnregisterStream();
+
+  char* AcquireSlab(bool force);
+  void ReleaseSlab(char* slab);
+  bool Reserve(size_t bytes);
+  void Unreserve(size_t bytes);
+
+  size_t GetFairShare();
+  bool IsUnderPressure();
+private:
+  CSFTPBufferPool();
+  ~CSFTPBufferPool();
+  CSFTPBufferPool& operator=(const CSFTPBufferPool&);
+  size_t GetCommitted() const;
+  void UpdatePressure();
+
+  PLATFORM::CMutex m_lock;
+  std::vector<char*> m_free;
+  size_t m_budget;
+  size_t m_used; // Slabs handed out and reserved bytes
+  unsigned int m_streams;
+  bool m_pressure;
+};
@@ -0,0 +1,225 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "SFTPConnector.h"
+#include "platform/util/timeutils.h"
+#include <algorithm>
+#include <sstream>
+#include "libXBMC_addon.h"
+
+#ifndef TARGET_WINDOWS
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#endif
+
+extern ADDON::CHelper_libXBMC_addon* XBMC;
+
+// getaddrinfo() doesn't expose record TTLs, resolved addresses are kept this long
+#define SFTP_DNS_CACHE_MS 60000
+// Delay before the next candidate address is tried while earlier ones are still connecting
+#define SFTP_CONNECT_ATTEMPT_DELAY_MS 250
+
+CSFTPConnector& CSFTPConnector::Get()
+{
+  static CSFTPConnector instance;
+
+  return instance;
+}
+
+/*!
+ \brief Connects to the fastest reachable address of the host.
+ \return Returns a connected blocking socket, or SSH_INVALID_SOCKET to let libssh connect by itself.
+ */
+socket_t CSFTPConnector::Connect(const std::string& hostname, unsigned int port, uint32_t timeoutMs)
+{
+#ifdef TARGET_WINDOWS
+  return SSH_INVALID_SOCKET;
+#else
+  std::vector<Address> addresses;
+  if (!Resolve(hostname, port, addresses))
+    return SSH_INVALID_SOCKET;
+
+  socket_t fd = Race(addresses, timeoutMs);
+  if (fd == SSH_INVALID_SOCKET)
+  {
+    // The host may have moved, resolve again next time
+    Forget(hostname, port);
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPConnector: Failed to connect to any address of '%s'", hostname.c_str());
+  }
+
+  return fd;
+#endif
+}
+
+#ifndef TARGET_WINDOWS
+bool CSFTPConnector::Resolve(const std::string& hostname, unsigned int port, std::vector<Address>& addresses)
+{
+  std::stringstream service;
+  service << port;
+  std::string key = hostname + ":" + service.str();
+
+  {
+    PLATFORM::CLockObject lock(m_lock);
+    std::map<std::string, CachedAddresses>::const_iterator cached = m_cache.find(key);
+    if (cached != m_cache.end() && cached->second.expires > PLATFORM::GetTimeMs())
+    {
+      addresses = cached->second.addresses;
+      return true;
+    }
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+
+  struct addrinfo* result = NULL;
+  int error = getaddrinfo(hostname.c_str(), service.str().c_str(), &hints, &result);
+  if (error != 0 || !result)
+  {
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPConnector: Failed to resolve '%s': %s", hostname.c_str(), gai_strerror(error));
+    return false;
+  }
+
+  // Interleave the families, starting with the one the resolver preferred
+  std::vector<Address> preferred, other;
+  int firstFamily = result->ai_family;
+  for (struct addrinfo* info = result; info; info = info->ai_next)
+  {
+    if (info->ai_addrlen > sizeof(struct sockaddr_storage))
+      continue;
+
+    Address address;
+    memcpy(&address.address, info->ai_addr, info->ai_addrlen);
+    address.length = info->ai_addrlen;
+    (info->ai_family == firstFamily ? preferred : other).push_back(address);
+  }
+  freeaddrinfo(result);
+
+  addresses.clear();
+  for (size_t i = 0; i < preferred.size() || i < other.size(); i++)
+  {
+    if (i < preferred.size())
+      addresses.push_back(preferred[i]);
+    if (i < other.size())
+      addresses.push_back(other[i]);
+  }
+
+  PLATFORM::CLockObject lock(m_lock);
+  CachedAddresses& cached = m_cache[key];
+  cached.expires = PLATFORM::GetTimeMs() + SFTP_DNS_CACHE_MS;
+  cached.addresses = addresses;
+
+  return !addresses.empty();
+}
+
+void CSFTPConnector::Forget(const std::string& hostname, unsigned int port)
+{
+  std::stringstream key;
+  key << hostname << ":" << port;
+
+  PLATFORM::CLockObject lock(m_lock);
+  m_cache.erase(key.str());
+}
+
+/*!
+ \brief Starts connecting to the addresses one after another, each SFTP_CONNECT_ATTEMPT_DELAY_MS
+        or as soon as the previous attempt failed, and keeps the first that connects.
+ */
+socket_t CSFTPConnector::Race(const std::vector<Address>& addresses, uint32_t timeoutMs)
+{
+  std::vector<struct pollfd> attempts;
+  size_t next = 0;
+  socket_t winner = SSH_INVALID_SOCKET;
+  PLATFORM::CTimeout timeout(timeoutMs);
+  int64_t nextAttempt = 0;
+
+  while (winner == SSH_INVALID_SOCKET && timeout.TimeLeft() > 0)
+  {
+    if (next < addresses.size() && (attempts.empty() || PLATFORM::GetTimeMs() >= nextAttempt))
+    {
+      const Address& address = addresses[next++];
+      socket_t fd = socket(address.address.ss_family, SOCK_STREAM, 0);
+      if (fd != SSH_INVALID_SOCKET)
+      {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        if (connect(fd, (const struct sockaddr*)&address.address, address.length) == 0 || errno == EINPROGRESS)
+        {
+          struct pollfd attempt;
+          attempt.fd = fd;
+          attempt.events = POLLOUT;
+          attempt.revents = 0;
+          attempts.push_back(attempt);
+        }
+        else
+          close(fd);
+      }
+      nextAttempt = PLATFORM::GetTimeMs() + SFTP_CONNECT_ATTEMPT_DELAY_MS;
+      continue;
+    }
+
+    if (attempts.empty())
+      break;
+
+    int wait = timeout.TimeLeft();
+    if (next < addresses.size())
+      wait = std::min(wait, (int)std::max((int64_t)0, nextAttempt - PLATFORM::GetTimeMs()));
+
+    if (poll(&attempts[0], attempts.size(), wait) < 0 && errno != EINTR)
+      break;
+
+    for (size_t i = 0; i < attempts.size();)
+    {
+      if (attempts[i].revents == 0)
+      {
+        i++;
+        continue;
+      }
+
+      int error = 0;
+      socklen_t length = sizeof(error);
+      if (winner == SSH_INVALID_SOCKET &&
+          getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0)
+        winner = attempts[i].fd;
+      else
+      {
+        close(attempts[i].fd);
+        // A failed attempt makes room for the next candidate right away
+        nextAttempt = 0;
+      }
+
+      attempts.erase(attempts.begin() + i);
+    }
+  }
+
+  for (size_t i = 0; i < attempts.size(); i++)
+    close(attempts[i].fd);
+
+  if (winner != SSH_INVALID_SOCKET)
+    fcntl(winner, F_SETFL, fcntl(winner, F_GETFL, 0) & ~O_NONBLOCK);
+
+  return winner;
+}
+#endif
@@ -0,0 +1,71 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "platform/threads/mutex.h"
+#include <libssh/libssh.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifndef TARGET_WINDOWS
+#include <sys/socket.h>
+#endif
+
+/*!
+ \brief Establishes the TCP connection for a session before it is handed to libssh.
+
+ Resolved addresses are cached, and IPv6 and IPv4 candidates are raced against
+ each other (RFC 8305, happy eyeballs) so a broken address family costs a fraction
+ of a second instead of a full connect timeout per address.
+ */
+class CSFTPConnector
+{
+public:
+  static CSFTPConnector& Get();
+
+  socket_t Connect(const std::string& hostname, unsigned int port, uint32_t timeoutMs);
+private:
+  CSFTPConnector() {}
+  CSFTPConnector& operator=(const CSFTPConnector&);
+
+#ifndef TARGET_WINDOWS
+  struct Address
+  {
+    struct sockaddr_storage address;
+    socklen_t length;
+  };
+
+  struct CachedAddresses
+  {
+    int64_t expires;
+    std::vector<Address> addresses;
+  };
+
+  bool Resolve(const std::string& hostname, unsigned int port, std::vector<Address>& addresses);
+  void Forget(const std::string& hostname, unsigned int port);
+  socket_t Race(const std::vector<Address>& addresses, uint32_t timeoutMs);
+
+  PLATFORM::CMutex m_lock;
+  std::map<std::string, CachedAddresses> m_cache;
+#endif
+};
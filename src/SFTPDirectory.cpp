@@ -0,0 +1,277 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "SFTPDirectory.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Folders and files NAS boxes and other systems leave in shares, never media
+static const char* JunkNames[] = { "@eaDir", "#recycle", "#snapshot", "$RECYCLE.BIN", "System Volume Information",
+                                   "lost+found", "Thumbs.db", "desktop.ini", NULL };
+
+// Case insensitive check whether name starts with prefix, which has to be lower case
+static bool StartsWithNoCase(const char* name, const char* prefix)
+{
+  for (; *prefix; name++, prefix++)
+  {
+    if (tolower((unsigned char)*name) != *prefix)
+      return false;
+  }
+  return true;
+}
+
+// Scene releases ship short preview clips as "sample.mkv", "name-sample.mkv" or in a "Sample" folder
+static bool IsSample(const char* name)
+{
+  if (StartsWithNoCase(name, "sample") && (name[6] == '\0' || name[6] == '.'))
+    return true;
+
+  for (const char* c = name; *c; c++)
+  {
+    if ((*c == '-' || *c == '.' || *c == '_') && StartsWithNoCase(c + 1, "sample."))
+      return true;
+  }
+  return false;
+}
+
+static std::string DecodeOption(const std::string& value)
+{
+  std::string decoded;
+  for (size_t i = 0; i < value.size(); i++)
+  {
+    if (value[i] == '%' && i + 2 < value.size() && isxdigit((unsigned char)value[i + 1]) && isxdigit((unsigned char)value[i + 2]))
+    {
+      decoded += (char)strtol(value.substr(i + 1, 2).c_str(), NULL, 16);
+      i += 2;
+    }
+    else if (value[i] == '+')
+      decoded += ' ';
+    else
+      decoded += value[i];
+  }
+  return decoded;
+}
+
+static bool IsTrue(const std::string& value)
+{
+  return value == "1" || value == "true" || value == "yes";
+}
+
+CSFTPDirectoryFilter::CSFTPDirectoryFilter()
+  : m_hidden(true),
+    m_foldersOnly(false)
+{
+}
+
+/*!
+ \brief Reads the filter from the URL options, e.g. "?filemask=.mkv|.avi&hidden=false", unknown keys are ignored.
+ */
+CSFTPDirectoryFilter::CSFTPDirectoryFilter(const char* options)
+  : m_hidden(true),
+    m_foldersOnly(false)
+{
+  if (!options)
+    return;
+
+  std::string query = options;
+  if (!query.empty() && query[0] == '?')
+    query.erase(0, 1);
+  if (!query.empty())
+    m_options = "?" + query;
+
+  size_t start = 0;
+  while (start < query.size())
+  {
+    size_t end = query.find('&', start);
+    if (end == std::string::npos)
+      end = query.size();
+
+    std::string option = query.substr(start, end - start);
+    size_t separator = option.find('=');
+    if (separator != std::string::npos)
+      SetOption(DecodeOption(option.substr(0, separator)), DecodeOption(option.substr(separator + 1)));
+
+    start = end + 1;
+  }
+}
+
+void CSFTPDirectoryFilter::SetOption(const std::string& key, const std::string& value)
+{
+  if (key == "filemask")
+  {
+    size_t start = 0;
+    while (start <= value.size())
+    {
+      size_t end = value.find('|', start);
+      if (end == std::string::npos)
+        end = value.size();
+
+      std::string extension = value.substr(start, end - start);
+      for (size_t i = 0; i < extension.size(); i++)
+        extension[i] = tolower((unsigned char)extension[i]);
+      if (!extension.empty() && extension[0] != '.')
+        extension.insert(0, ".");
+      if (!extension.empty())
+        m_extensions.push_back(extension);
+
+      start = end + 1;
+    }
+  }
+  else if (key == "hidden")
+    m_hidden = IsTrue(value);
+  else if (key == "foldersonly")
+    m_foldersOnly = IsTrue(value);
+}
+
+/*!
+ \brief Checks whether an item is left out by its name alone, before its type is known.
+ */
+bool CSFTPDirectoryFilter::ExcludesName(const char* name) const
+{
+  if (m_hidden)
+    return false;
+
+  if (name[0] == '.')
+    return true;
+
+  for (const char** junk = JunkNames; *junk; junk++)
+  {
+    if (strcmp(name, *junk) == 0)
+      return true;
+  }
+
+  return IsSample(name);
+}
+
+/*!
+ \brief Checks whether an item of known type is handed to Kodi.
+ */
+bool CSFTPDirectoryFilter::Includes(const char* name, bool folder) const
+{
+  if (ExcludesName(name))
+    return false;
+  if (folder)
+    return true;
+  if (m_foldersOnly)
+    return false;
+  if (m_extensions.empty())
+    return true;
+
+  const char* extension = strrchr(name, '.');
+  if (!extension)
+    return false;
+
+  size_t length = strlen(extension);
+  for (std::vector<std::string>::const_iterator mask = m_extensions.begin(); mask != m_extensions.end(); ++mask)
+  {
+    // Masks are stored lower case
+    size_t i = 0;
+    while (i < length && i < mask->size() && tolower((unsigned char)extension[i]) == (*mask)[i])
+      i++;
+    if (i == length && i == mask->size())
+      return true;
+  }
+
+  return false;
+}
+
+/*!
+ \brief Turns a path from a VFS URL into one the server understands, "~" is the home directory.
+ */
+std::string CSFTPDirectory::CorrectPath(const std::string& path)
+{
+  if (path == "~")
+    return "./";
+  else if (path.substr(0, 2) == "~/")
+    return "./" + path.substr(2);
+  else
+    return "/" + path;
+}
+
+/*!
+ \brief Fills \e entry for the item \e itemName in \e folder.
+ \param base URL prefix of the share, prepended to the path of the entry.
+ \param folder Listed folder relative to \e base, including the trailing slash.
+ \param options URL options appended to the path of a folder entry, so listing it applies the same filter.
+ \param attributes Attributes of the item, for symlinks those of the target.
+ */
+void CSFTPDirectory::ToDirEntry(const std::string& base, const std::string& folder, const std::string& itemName,
+                                const std::string& options, sftp_attributes attributes, VFSDirEntry& entry)
+{
+  std::string localPath = folder;
+  localPath.append(itemName);
+
+  entry.label = strdup(itemName.c_str());
+  entry.title = NULL;
+
+  if (itemName[0] == '.')
+  {
+    entry.properties = new VFSProperty;
+    entry.properties->name = strdup("file:hidden");
+    entry.properties->val = strdup("true");
+    entry.num_props = 1;
+  }
+  else
+  {
+    entry.properties = NULL;
+    entry.num_props = 0;
+  }
+
+/*  if (attributes->flags & SSH_FILEXFER_ATTR_ACMODTIME)
+  {
+    entry.mtime.dwLowDateTime = attributes->mtime64 & ((1LL << 32)-1);
+    entry.mtime.dwHighDateTime = attributes->mtime64 >> 32;
+  }
+*/
+  if (attributes->type & SSH_FILEXFER_TYPE_DIRECTORY)
+  {
+    localPath.append("/");
+    localPath.append(options);
+    entry.folder = true;
+    entry.size = 0;
+  }
+  else
+  {
+    entry.size = attributes->size;
+    entry.folder = false;
+  }
+
+  entry.path = strdup((base+localPath).c_str());
+}
+
+/*!
+ \brief Releases everything ToDirEntry() allocated for \e items, the vector itself stays with the caller.
+ */
+void CSFTPDirectory::FreeEntries(std::vector<VFSDirEntry>& items)
+{
+  for (size_t i=0;i<items.size();++i)
+  {
+    free(items[i].label);
+    for (size_t j=0;j<items[i].num_props;++j)
+    {
+      free(items[i].properties[j].name);
+      free(items[i].properties[j].val);
+    }
+    delete items[i].properties;
+    free(items[i].path);
+  }
+  items.clear();
+}
@@ -0,0 +1,71 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include "xbmc_addon_dll.h"
+#include "kodi_vfs_types.h"
+#include <string>
+#include <vector>
+
+/*!
+ \brief Decides which items of a listing are handed to Kodi, configured from the options of the VFS URL.
+
+ Understands "filemask" (extensions separated by '|', folders always match),
+ "hidden=false" (leaves out dot files, the clutter NAS boxes create and sample
+ clips) and "foldersonly=true". Name based checks run before anything is
+ allocated for an item, so excluded symlinks are not even resolved. The options
+ are passed on to the folders of the listing, so their listings are filtered too.
+ */
+class CSFTPDirectoryFilter
+{
+public:
+  CSFTPDirectoryFilter();
+  explicit CSFTPDirectoryFilter(const char* options);
+
+  bool IsActive() const { return !m_extensions.empty() || !m_hidden || m_foldersOnly; }
+  bool ExcludesName(const char* name) const;
+  bool Includes(const char* name, bool folder) const;
+  const std::string& GetOptions() const { return m_options; }
+private:
+  void SetOption(const std::string& key, const std::string& value);
+
+  std::string m_options;
+  std::vector<std::string> m_extensions;
+  bool m_hidden;
+  bool m_foldersOnly;
+};
+
+/*!
+ \brief Conversion between remote paths and attributes and what the VFS API hands to Kodi.
+
+ Kept free of any session state so the listing path can be measured without a
+ server, see the benchmark target.
+ */
+class CSFTPDirectory
+{
+public:
+  static std::string CorrectPath(const std::string& path);
+  static void ToDirEntry(const std::string& base, const std::string& folder, const std::string& itemName,
+                         const std::string& options, sftp_attributes attributes, VFSDirEntry& entry);
+  static void FreeEntries(std::vector<VFSDirEntry>& items);
+};
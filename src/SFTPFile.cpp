@@ -21,9 +21,24 @@
 #include "libXBMC_addon.h"
 #include "platform/threads/mutex.h"
 #include "SFTPSession.h"
+#include "SFTPReadAhead.h"
+#include "SFTPBufferPool.h"
+#include "SFTPDirectory.h"
+#include "SFTPTrace.h"
 
+#include <algorithm>
 #include <map>
 #include <sstream>
+#include <vector>
+
+// Files up to this size are fetched completely on open and served from memory
+#define SFTP_SMALL_FILE_SIZE (512 * 1024)
+
+// Longest time a browsing call waits before failing so a stalled server can't hang the UI
+#define SFTP_METADATA_DEADLINE_MS 3000
+
+// Longest time a read waits before failing, long enough to ride out a brief stall
+#define SFTP_PLAYBACK_DEADLINE_MS 10000
 
 ADDON::CHelper_libXBMC_addon *XBMC           = NULL;
 
@@ -46,6 +61,7 @@ ADDON_STATUS ADDON_Create(void* hdl, void* props)
     return ADDON_STATUS_PERMANENT_FAILURE;
   }
 
+  CSFTPTrace::Get().Open();
   return ADDON_STATUS_OK;
 }
 
@@ -63,6 +79,8 @@ void ADDON_Stop()
 //-----------------------------------------------------------------------------
 void ADDON_Destroy()
 {
+  CSFTPSessionManager::Get().Shutdown();
+  CSFTPTrace::Get().Close();
   XBMC=NULL;
 }
 
@@ -121,11 +139,43 @@ void ADDON_Announce(const char *flag, const char *sender, const char *message, c
 
 struct SFTPContext
 {
+  SFTPContext() : sftp_handle(NULL), reader(NULL), buffered(false), position(0), reserved(0) {}
+
   CSFTPSessionPtr session;
   sftp_file sftp_handle;
+  CSFTPReadAhead* reader;
   std::string file;
+  std::vector<char> content; // Whole file when buffered, remote handle is closed then
+  bool buffered;
+  uint64_t position;
+  size_t reserved; // Bytes of content accounted in CSFTPBufferPool
 };
 
+static void BufferSmallFile(SFTPContext* ctx, const struct __stat64& buffer)
+{
+  if (!S_ISREG(buffer.st_mode) || buffer.st_size > SFTP_SMALL_FILE_SIZE ||
+      !CSFTPBufferPool::Get().Reserve(buffer.st_size))
+    return;
+
+  ctx->content.resize(buffer.st_size);
+  int rc = ctx->session->ReadFully(ctx->sftp_handle, ctx->content.empty() ? NULL : &ctx->content[0], ctx->content.size(),
+                                   SFTP_METADATA_DEADLINE_MS);
+  if (rc < 0)
+  {
+    // Fall back to reading through the remote handle
+    CSFTPBufferPool::Get().Unreserve(ctx->content.size());
+    std::vector<char>().swap(ctx->content);
+    ctx->session->Seek(ctx->sftp_handle, 0, SFTP_METADATA_DEADLINE_MS);
+    return;
+  }
+
+  ctx->content.resize(rc);
+  ctx->reserved = buffer.st_size;
+  ctx->buffered = true;
+  ctx->session->CloseFileHandle(ctx->sftp_handle, SFTP_METADATA_DEADLINE_MS);
+  ctx->sftp_handle = NULL;
+}
+
 void* Open(VFSURL* url)
 {
   SFTPContext* result = new SFTPContext;
@@ -135,9 +185,26 @@ void* Open(VFSURL* url)
   if (result->session)
   {
     result->file = url->filename;
-    result->sftp_handle = result->session->CreateFileHande(result->file);
+    result->sftp_handle = result->session->CreateFileHande(result->file, SFTP_METADATA_DEADLINE_MS);
     if (result->sftp_handle)
+    {
+      struct __stat64 buffer;
+      uint64_t size = (uint64_t)-1; // Unknown, read-ahead is not bounded then
+      time_t mtime = 0;
+      if (result->session->FStat(result->sftp_handle, &buffer, SFTP_METADATA_DEADLINE_MS) == 0)
+      {
+        size = buffer.st_size;
+        mtime = buffer.st_mtime;
+
+        // A file that is still being written has to be read through the handle to see it grow
+        if (!CSFTPReadAhead::IsGrowing(mtime))
+          BufferSmallFile(result, buffer);
+      }
+
+      if (!result->buffered)
+        result->reader = new CSFTPReadAhead(result->session, result->sftp_handle, result->file, size, mtime);
       return result;
+    }
   }
   else
     XBMC->Log(ADDON::LOG_ERROR, "SFTPFile: Failed to allocate session");
@@ -149,14 +216,24 @@ void* Open(VFSURL* url)
 ssize_t Read(void* context, void* lpBuf, size_t uiBufSize)
 {
   SFTPContext* ctx = (SFTPContext*)context;
-  if (ctx && ctx->session && ctx->sftp_handle)
+  if (ctx && ctx->buffered)
+  {
+    if (ctx->position >= ctx->content.size())
+      return 0;
+
+    size_t length = std::min(uiBufSize, (size_t)(ctx->content.size() - ctx->position));
+    memcpy(lpBuf, &ctx->content[ctx->position], length);
+    ctx->position += length;
+    return length;
+  }
+  else if (ctx && ctx->reader)
   {
-    int rc = ctx->session->Read(ctx->sftp_handle, lpBuf, (size_t)uiBufSize);
+    ssize_t rc = ctx->reader->Read(lpBuf, uiBufSize, SFTP_PLAYBACK_DEADLINE_MS);
 
     if (rc >= 0)
       return rc;
     else
-      XBMC->Log(ADDON::LOG_ERROR, "SFTPFile: Failed to read %i", rc);
+      XBMC->Log(ADDON::LOG_ERROR, "SFTPFile: Failed to read %i", (int)rc);
   }
   else
     XBMC->Log(ADDON::LOG_ERROR, "SFTPFile: Can't read without a filehandle");
@@ -167,8 +244,10 @@ ssize_t Read(void* context, void* lpBuf, size_t uiBufSize)
 bool Close(void* context)
 {
   SFTPContext* ctx = (SFTPContext*)context;
+  delete ctx->reader;
   if (ctx->session && ctx->sftp_handle)
-    ctx->session->CloseFileHandle(ctx->sftp_handle);
+    ctx->session->CloseFileHandle(ctx->sftp_handle, SFTP_METADATA_DEADLINE_MS);
+  CSFTPBufferPool::Get().Unreserve(ctx->reserved);
   delete ctx;
 
   return true;
@@ -177,8 +256,15 @@ bool Close(void* context)
 int64_t GetLength(void* context)
 {
   SFTPContext* ctx = (SFTPContext*)context;
+  if (ctx->buffered)
+    return ctx->content.size();
+
+  // The reader knows the size of the open file, including growth of a followed one
+  if (ctx->reader && ctx->reader->GetSize() != (uint64_t)-1)
+    return ctx->reader->GetSize();
+
   struct __stat64 buffer;
-  if (ctx->session->Stat(ctx->file.c_str(), &buffer) != 0)
+  if (ctx->session->Stat(ctx->file.c_str(), &buffer, SFTP_METADATA_DEADLINE_MS) != 0)
     return 0;
   else
     return buffer.st_size;
@@ -187,8 +273,10 @@ int64_t GetLength(void* context)
 int64_t GetPosition(void* context)
 {
   SFTPContext* ctx = (SFTPContext*)context;
-  if (ctx->session && ctx->sftp_handle)
-    return ctx->session->GetPosition(ctx->sftp_handle);
+  if (ctx->buffered)
+    return ctx->position;
+  else if (ctx->reader)
+    return ctx->reader->GetPosition();
 
   XBMC->Log(ADDON::LOG_ERROR, "SFTPFile: Can't get position without a filehandle for '%s'", ctx->file.c_str());
   return 0;
@@ -198,7 +286,7 @@ int64_t GetPosition(void* context)
 int64_t Seek(void* context, int64_t iFilePosition, int iWhence)
 {
   SFTPContext* ctx = (SFTPContext*)context;
-  if (ctx && ctx->session && ctx->sftp_handle)
+  if (ctx && (ctx->buffered || ctx->reader))
   {
     uint64_t position = 0;
     if (iWhence == SEEK_SET)
@@ -208,10 +296,13 @@ int64_t Seek(void* context, int64_t iFilePosition, int iWhence)
     else if (iWhence == SEEK_END)
       position = GetLength(context) + iFilePosition;
 
-    if (ctx->session->Seek(ctx->sftp_handle, position) == 0)
-      return GetPosition(context);
+    if (ctx->buffered)
+    {
+      ctx->position = position;
+      return position;
+    }
     else
-      return -1;
+      return ctx->reader->Seek(position, SFTP_PLAYBACK_DEADLINE_MS);
   }
   else
   {
@@ -224,7 +315,7 @@ bool Exists(VFSURL* url)
 {
   CSFTPSessionPtr session = CSFTPSessionManager::Get().CreateSession(url);
   if (session)
-    return session->FileExists(url->filename);
+    return session->FileExists(url->filename, SFTP_METADATA_DEADLINE_MS);
   else
   {
     XBMC->Log(ADDON::LOG_ERROR, "SFTPFile: Failed to create session to check exists for '%s'", url->filename);
@@ -236,7 +327,7 @@ int Stat(VFSURL* url, struct __stat64* buffer)
 {
   CSFTPSessionPtr session = CSFTPSessionManager::Get().CreateSession(url);
   if (session)
-    return session->Stat(url->filename, buffer);
+    return session->Stat(url->filename, buffer, SFTP_METADATA_DEADLINE_MS);
   else
   {
     XBMC->Log(ADDON::LOG_ERROR, "SFTPFile: Failed to create session to stat for '%s'", url->filename);
@@ -246,8 +337,42 @@ int Stat(VFSURL* url, struct __stat64* buffer)
 
 int IoControl(void* context, XFILE::EIoControl request, void* param)
 {
+  SFTPContext* ctx = (SFTPContext*)context;
   if(request == XFILE::IOCTRL_SEEK_POSSIBLE)
+  {
+    // Only players and their caches ask, plain copies never do
+    if (ctx && ctx->reader)
+      ctx->reader->SetInteractive();
     return 1;
+  }
+  else if (request == XFILE::IOCTRL_CACHE_SETRATE && ctx && param)
+  {
+    if (ctx->reader)
+    {
+      ctx->reader->SetInteractive();
+      ctx->reader->SetBitrate(*(unsigned int*)param);
+    }
+    return 0;
+  }
+  else if (request == XFILE::IOCTRL_CACHE_STATUS && ctx && param)
+  {
+    XFILE::SCacheStatus* status = (XFILE::SCacheStatus*)param;
+    if (ctx->buffered)
+    {
+      status->forward = ctx->position < ctx->content.size() ? ctx->content.size() - ctx->position : 0;
+      status->maxrate = 0;
+      status->currate = 0;
+      status->lowspeed = false;
+    }
+    else if (ctx->reader)
+    {
+      status->forward = ctx->reader->GetBufferedAhead();
+      status->maxrate = ctx->reader->GetBitrate();
+      status->currate = ctx->reader->GetFetchRate();
+      status->lowspeed = status->maxrate > 0 && status->currate > 0 && status->currate < status->maxrate;
+    }
+    return 0;
+  }
 
   return -1;
 }
@@ -266,7 +391,7 @@ bool DirectoryExists(VFSURL* url)
 {
   CSFTPSessionPtr session = CSFTPSessionManager::Get().CreateSession(url);
   if (session)
-    return session->DirectoryExists(url->filename);
+    return session->DirectoryExists(url->filename, SFTP_METADATA_DEADLINE_MS);
   else
   {
     XBMC->Log(ADDON::LOG_ERROR, "SFTPFile: Failed to create session to check exists");
@@ -281,7 +406,7 @@ void* GetDirectory(VFSURL* url, VFSDirEntry** items,
   CSFTPSessionPtr session = CSFTPSessionManager::Get().CreateSession(url);
   std::stringstream str;
   str << "sftp://" << url->username << ":" << url->password << "@" << url->hostname << ":" << url->port << "/";
-  if (!session->GetDirectory(str.str(), url->filename, *result))
+  if (!session->GetDirectory(str.str(), url->filename, *result, CSFTPDirectoryFilter(url->options), SFTP_METADATA_DEADLINE_MS))
   {
     delete result;
     return NULL;
@@ -297,17 +422,7 @@ void* GetDirectory(VFSURL* url, VFSDirEntry** items,
 void FreeDirectory(void* items)
 {
   std::vector<VFSDirEntry>& ctx = *(std::vector<VFSDirEntry>*)items;
-  for (size_t i=0;i<ctx.size();++i)
-  {
-    free(ctx[i].label);
-    for (size_t j=0;j<ctx[i].num_props;++j)
-    {
-      free(ctx[i].properties[j].name);
-      free(ctx[i].properties[j].val);
-    }
-    delete ctx[i].properties;
-    free(ctx[i].path);
-  }
+  CSFTPDirectory::FreeEntries(ctx);
   delete &ctx;
 }
 
@@ -0,0 +1,185 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "SFTPKnownHosts.h"
+#include "platform/util/timeutils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#ifndef TARGET_WINDOWS
+#include <pwd.h>
+#include <unistd.h>
+#endif
+#include <sstream>
+#include "libXBMC_addon.h"
+
+extern ADDON::CHelper_libXBMC_addon* XBMC;
+
+// The file is stat'ed at most this often, connects in between use the index as is
+#define SFTP_KNOWNHOSTS_RECHECK_MS 1000
+
+CSFTPKnownHosts& CSFTPKnownHosts::Get()
+{
+  static CSFTPKnownHosts instance;
+
+  return instance;
+}
+
+/*!
+ \brief Indexes the file libssh checks by default, which lives in the home directory libssh determines.
+
+ That is the passwd entry of the user rather than $HOME, except on Android where
+ the bundled libssh is patched to use $HOME. The file libssh checks is left alone,
+ so an index built from the wrong file only misses and libssh decides.
+ */
+CSFTPKnownHosts::CSFTPKnownHosts()
+  : m_mtime(0),
+    m_size(-1),
+    m_lastCheck(0),
+    m_usable(false)
+{
+#if defined(TARGET_WINDOWS)
+  const char* home = getenv("USERPROFILE");
+#elif defined(TARGET_ANDROID) || defined(ANDROID)
+  const char* home = getenv("HOME");
+#else
+  struct passwd* user = getpwuid(getuid());
+  const char* home = user ? user->pw_dir : NULL;
+#endif
+  if (home && *home)
+    m_path = std::string(home) + "/.ssh/known_hosts";
+}
+
+/*!
+ \brief Checks whether \e key of type \e keyType is listed for the host.
+ \return Returns \e true only if a plain entry for the host lists exactly this key, \e false if unsure.
+ */
+bool CSFTPKnownHosts::IsKnown(const std::string& hostname, unsigned int port, const std::string& keyType, const std::string& key)
+{
+  PLATFORM::CLockObject lock(m_lock);
+  Refresh();
+  if (!m_usable)
+    return false;
+
+  std::string host = hostname;
+  if (port != 22)
+  {
+    std::stringstream name;
+    name << "[" << hostname << "]:" << port;
+    host = name.str();
+  }
+
+  std::map<std::string, std::vector<HostKey> >::const_iterator entry = m_hosts.find(host);
+  if (entry == m_hosts.end())
+    return false;
+
+  for (std::vector<HostKey>::const_iterator hostKey = entry->second.begin(); hostKey != entry->second.end(); ++hostKey)
+  {
+    if (hostKey->type == keyType && hostKey->key == key)
+      return true;
+  }
+
+  return false;
+}
+
+/*!
+ \brief Forces a reload on the next lookup, used after libssh wrote to the file.
+ */
+void CSFTPKnownHosts::Invalidate()
+{
+  PLATFORM::CLockObject lock(m_lock);
+  m_lastCheck = 0;
+  m_size = -1;
+}
+
+void CSFTPKnownHosts::Refresh()
+{
+  int64_t now = PLATFORM::GetTimeMs();
+  if (m_path.empty() || (m_lastCheck != 0 && now - m_lastCheck < SFTP_KNOWNHOSTS_RECHECK_MS))
+    return;
+  m_lastCheck = now;
+
+  struct stat info;
+  if (stat(m_path.c_str(), &info) != 0)
+  {
+    m_usable = false;
+    m_hosts.clear();
+    m_size = -1;
+    return;
+  }
+
+  if (info.st_mtime != m_mtime || (int64_t)info.st_size != m_size)
+  {
+    m_mtime = info.st_mtime;
+    m_size = info.st_size;
+    Load();
+  }
+}
+
+void CSFTPKnownHosts::Load()
+{
+  m_hosts.clear();
+  m_usable = false;
+
+  FILE* file = fopen(m_path.c_str(), "r");
+  if (!file)
+    return;
+
+  char line[8192];
+  while (fgets(line, sizeof(line), file))
+  {
+    std::stringstream fields(line);
+    std::string hosts;
+    HostKey hostKey;
+    if (!(fields >> hosts) || hosts[0] == '#')
+      continue;
+
+    // Revocations and CA entries change what a plain entry means, leave such files to libssh
+    if (hosts[0] == '@')
+    {
+      fclose(file);
+      m_hosts.clear();
+      XBMC->Log(ADDON::LOG_DEBUG, "SFTPKnownHosts: '%s' has marker entries, not indexing it", m_path.c_str());
+      return;
+    }
+
+    if (!(fields >> hostKey.type >> hostKey.key))
+      continue;
+
+    size_t start = 0;
+    while (start <= hosts.size())
+    {
+      size_t end = hosts.find(',', start);
+      if (end == std::string::npos)
+        end = hosts.size();
+
+      std::string host = hosts.substr(start, end - start);
+      // Hashed names and patterns can't be looked up directly
+      if (!host.empty() && host[0] != '|' && host[0] != '!' && host.find_first_of("*?") == std::string::npos)
+        m_hosts[host].push_back(hostKey);
+
+      start = end + 1;
+    }
+  }
+
+  fclose(file);
+  m_usable = true;
+  XBMC->Log(ADDON::LOG_DEBUG, "SFTPKnownHosts: Indexed %u hosts from '%s'", (unsigned int)m_hosts.size(), m_path.c_str());
+}
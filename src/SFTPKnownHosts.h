@@ -0,0 +1,63 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "platform/threads/mutex.h"
+#include <stdint.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+
+/*!
+ \brief In-memory index of the plain host entries in known_hosts, reloaded when the file changes.
+
+ Only answers whether a host key is known. Anything the index cannot vouch for
+ (hashed or wildcard entries, changed or missing keys) is left to libssh's own
+ check, which also takes care of writing new hosts.
+ */
+class CSFTPKnownHosts
+{
+public:
+  static CSFTPKnownHosts& Get();
+
+  bool IsKnown(const std::string& hostname, unsigned int port, const std::string& keyType, const std::string& key);
+  void Invalidate();
+private:
+  CSFTPKnownHosts();
+  CSFTPKnownHosts& operator=(const CSFTPKnownHosts&);
+  void Refresh();
+  void Load();
+
+  struct HostKey
+  {
+    std::string type;
+    std::string key;
+  };
+
+  PLATFORM::CMutex m_lock;
+  std::string m_path;
+  time_t m_mtime;
+  int64_t m_size;
+  int64_t m_lastCheck;
+  bool m_usable;
+  std::map<std::string, std::vector<HostKey> > m_hosts;
+};
@@ -0,0 +1,503 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "SFTPMetadataCache.h"
+#include "SFTPBufferPool.h"
+#include "SFTPSession.h"
+#include "platform/util/timeutils.h"
+#include <stdio.h>
+#include <string.h>
+#include <sstream>
+#include "libXBMC_addon.h"
+
+extern ADDON::CHelper_libXBMC_addon* XBMC;
+
+// Entries confirmed by the server longer ago than this are served but revalidated
+#define SFTP_METADATA_REVALIDATE_MS 30000
+// Most memory the cache of one host may hold
+#define SFTP_METADATA_CACHE_SIZE (4 * 1024 * 1024)
+// Changed caches are written out at most this often while running
+#define SFTP_SNAPSHOT_INTERVAL_MS 60000
+// Bump when the layout of the snapshot changes, older files are ignored
+#define SFTP_SNAPSHOT_VERSION 1
+#define SFTP_SNAPSHOT_MAGIC "SFTPSNAP"
+
+// Rough per entry overhead of the maps and strings, used for memory accounting only
+#define SFTP_METADATA_ENTRY_OVERHEAD 64
+
+static void AppendUInt32(std::string& buffer, uint32_t value)
+{
+  buffer.append((const char*)&value, sizeof(value));
+}
+
+static void AppendUInt64(std::string& buffer, uint64_t value)
+{
+  buffer.append((const char*)&value, sizeof(value));
+}
+
+static void AppendString(std::string& buffer, const std::string& value)
+{
+  AppendUInt32(buffer, value.size());
+  buffer.append(value);
+}
+
+/*!
+ \brief Bounds checked reading of a snapshot, every read fails once the data ran out.
+ */
+class CSnapshotReader
+{
+public:
+  CSnapshotReader(const std::string& data) : m_data(data), m_offset(0) {}
+
+  bool ReadUInt32(uint32_t& value) { return Read(&value, sizeof(value)); }
+  bool ReadUInt64(uint64_t& value) { return Read(&value, sizeof(value)); }
+  bool ReadInt64(int64_t& value) { return Read(&value, sizeof(value)); }
+  bool ReadString(std::string& value)
+  {
+    uint32_t length;
+    if (!ReadUInt32(length) || length > m_data.size() - m_offset)
+      return false;
+
+    value.assign(m_data, m_offset, length);
+    m_offset += length;
+    return true;
+  }
+private:
+  bool Read(void* value, size_t length)
+  {
+    if (length > m_data.size() - m_offset)
+      return false;
+
+    memcpy(value, m_data.data() + m_offset, length);
+    m_offset += length;
+    return true;
+  }
+
+  const std::string& m_data;
+  size_t m_offset;
+};
+
+// Caches of all hosts used since the add-on was loaded
+static PLATFORM::CMutex registryLock;
+static std::map<std::string, CSFTPMetadataCachePtr> registry;
+
+/*!
+ \brief Returns the cache for the user, host and port of \e url, creating it on first use.
+
+ The snapshot itself is only read when the cache is first used.
+ */
+CSFTPMetadataCachePtr CSFTPMetadataCache::ForHost(const VFSURL* url)
+{
+  std::stringstream identity;
+  identity << url->username << "@" << url->hostname << ":" << url->port;
+
+  PLATFORM::CLockObject lock(registryLock);
+  std::map<std::string, CSFTPMetadataCachePtr>::iterator cache = registry.find(identity.str());
+  if (cache != registry.end())
+    return cache->second;
+
+  std::string file;
+  char* folder = XBMC->TranslateSpecialProtocol("special://profile/addon_data/vfs.sftp/");
+  if (folder)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "snapshot-%08x.bin", CSFTPSessionManager::HashIdentity(url));
+    file = std::string(folder) + name;
+    XBMC->FreeString(folder);
+  }
+
+  CSFTPMetadataCachePtr created(new CSFTPMetadataCache(identity.str(), file));
+  registry[identity.str()] = created;
+  return created;
+}
+
+/*!
+ \brief Writes out the snapshots of all changed caches.
+ \param force If \e false, caches saved less than SFTP_SNAPSHOT_INTERVAL_MS ago are skipped.
+ */
+void CSFTPMetadataCache::SaveAll(bool force)
+{
+  std::vector<CSFTPMetadataCachePtr> caches;
+  {
+    PLATFORM::CLockObject lock(registryLock);
+    for (std::map<std::string, CSFTPMetadataCachePtr>::iterator cache = registry.begin(); cache != registry.end(); ++cache)
+      caches.push_back(cache->second);
+  }
+
+  for (size_t i = 0; i < caches.size(); i++)
+    caches[i]->Save(force);
+}
+
+CSFTPMetadataCache::CSFTPMetadataCache(const std::string& identity, const std::string& file)
+  : m_identity(identity),
+    m_file(file),
+    m_loaded(false),
+    m_dirty(false),
+    m_lastSave(PLATFORM::GetTimeMs()),
+    m_reserved(0)
+{
+}
+
+/*!
+ \brief Looks up the listing of \e folder, queueing it for revalidation if it wasn't confirmed recently.
+ */
+bool CSFTPMetadataCache::GetDirectory(const std::string& folder, std::vector<Item>& items)
+{
+  PLATFORM::CLockObject lock(m_lock);
+  Load();
+
+  std::map<std::string, Directory>::const_iterator directory = m_directories.find(folder);
+  if (directory == m_directories.end())
+    return false;
+
+  if (IsStale(directory->second.checked, PLATFORM::GetTimeMs()))
+    m_pendingFolders.insert(folder);
+
+  items = directory->second.items;
+  return true;
+}
+
+/*!
+ \brief Stores the listing of \e folder as just confirmed by the server.
+ \param mtime Modification time of \e folder itself, 0 if unknown which forces a new listing on revalidation.
+ */
+void CSFTPMetadataCache::PutDirectory(const std::string& folder, int64_t mtime, const std::vector<Item>& items)
+{
+  PLATFORM::CLockObject lock(m_lock);
+  Load();
+
+  std::map<std::string, Directory>::iterator existing = m_directories.find(folder);
+  if (existing != m_directories.end())
+  {
+    Uncharge(existing->second.charged);
+    m_directories.erase(existing);
+  }
+
+  Directory directory;
+  directory.mtime = mtime;
+  directory.checked = PLATFORM::GetTimeMs();
+  directory.items = items;
+  directory.charged = Footprint(folder, directory);
+  m_dirty = true;
+  if (!Charge(directory.charged))
+    return;
+
+  m_directories[folder] = directory;
+}
+
+/*!
+ \brief Marks the listing of \e folder as confirmed if the directory wasn't modified since it was taken.
+ \return Returns \e false if the listing is unknown or outdated and should be fetched again.
+ */
+bool CSFTPMetadataCache::ConfirmDirectory(const std::string& folder, int64_t mtime)
+{
+  PLATFORM::CLockObject lock(m_lock);
+  std::map<std::string, Directory>::iterator directory = m_directories.find(folder);
+  if (directory == m_directories.end() || directory->second.mtime == 0 || directory->second.mtime != mtime)
+    return false;
+
+  directory->second.checked = PLATFORM::GetTimeMs();
+  return true;
+}
+
+/*!
+ \brief Looks up the attributes of \e path, queueing them for revalidation if they weren't confirmed recently.
+ */
+bool CSFTPMetadataCache::GetAttributes(const std::string& path, Attributes& attributes)
+{
+  PLATFORM::CLockObject lock(m_lock);
+  Load();
+
+  std::map<std::string, CachedAttributes>::const_iterator cached = m_attributes.find(path);
+  if (cached == m_attributes.end())
+    return false;
+
+  if (IsStale(cached->second.checked, PLATFORM::GetTimeMs()))
+    m_pendingPaths.insert(path);
+
+  attributes = cached->second.attributes;
+  return true;
+}
+
+void CSFTPMetadataCache::PutAttributes(const std::string& path, const Attributes& attributes)
+{
+  PLATFORM::CLockObject lock(m_lock);
+  Load();
+
+  std::map<std::string, CachedAttributes>::iterator existing = m_attributes.find(path);
+  if (existing != m_attributes.end())
+  {
+    if (memcmp(&existing->second.attributes, &attributes, sizeof(attributes)) != 0)
+      m_dirty = true;
+    existing->second.attributes = attributes;
+    existing->second.checked = PLATFORM::GetTimeMs();
+    return;
+  }
+
+  CachedAttributes cached;
+  cached.attributes = attributes;
+  cached.checked = PLATFORM::GetTimeMs();
+  cached.charged = Footprint(path);
+  if (!Charge(cached.charged))
+    return;
+
+  m_attributes[path] = cached;
+  m_dirty = true;
+}
+
+/*!
+ \brief Forgets the listing and attributes of \e path, used once the server no longer has it.
+ */
+void CSFTPMetadataCache::Remove(const std::string& path)
+{
+  PLATFORM::CLockObject lock(m_lock);
+  std::map<std::string, Directory>::iterator directory = m_directories.find(path);
+  if (directory != m_directories.end())
+  {
+    Uncharge(directory->second.charged);
+    m_directories.erase(directory);
+    m_dirty = true;
+  }
+
+  std::map<std::string, CachedAttributes>::iterator cached = m_attributes.find(path);
+  if (cached != m_attributes.end())
+  {
+    Uncharge(cached->second.charged);
+    m_attributes.erase(cached);
+    m_dirty = true;
+  }
+}
+
+bool CSFTPMetadataCache::HasPending()
+{
+  PLATFORM::CLockObject lock(m_lock);
+  return !m_pendingFolders.empty() || !m_pendingPaths.empty();
+}
+
+/*!
+ \brief Hands the folders and paths queued for revalidation to the caller and clears the queue.
+ */
+void CSFTPMetadataCache::TakePending(std::vector<std::string>& folders, std::vector<std::string>& paths)
+{
+  PLATFORM::CLockObject lock(m_lock);
+  folders.assign(m_pendingFolders.begin(), m_pendingFolders.end());
+  paths.assign(m_pendingPaths.begin(), m_pendingPaths.end());
+  m_pendingFolders.clear();
+  m_pendingPaths.clear();
+}
+
+/*!
+ \brief Writes the snapshot if anything changed, to a temporary file that then replaces the old one.
+ \param force If \e false, nothing is written if the last save was less than SFTP_SNAPSHOT_INTERVAL_MS ago.
+ */
+void CSFTPMetadataCache::Save(bool force)
+{
+  std::string data;
+  {
+    PLATFORM::CLockObject lock(m_lock);
+    int64_t now = PLATFORM::GetTimeMs();
+    if (!m_dirty || m_file.empty() || (!force && now - m_lastSave < SFTP_SNAPSHOT_INTERVAL_MS))
+      return;
+
+    data.append(SFTP_SNAPSHOT_MAGIC);
+    AppendUInt32(data, SFTP_SNAPSHOT_VERSION);
+    AppendString(data, m_identity);
+
+    AppendUInt32(data, m_directories.size());
+    for (std::map<std::string, Directory>::const_iterator directory = m_directories.begin(); directory != m_directories.end(); ++directory)
+    {
+      AppendString(data, directory->first);
+      AppendUInt64(data, directory->second.mtime);
+      AppendUInt32(data, directory->second.items.size());
+      for (std::vector<Item>::const_iterator item = directory->second.items.begin(); item != directory->second.items.end(); ++item)
+      {
+        AppendString(data, item->name);
+        AppendUInt32(data, item->folder ? 1 : 0);
+        AppendUInt64(data, item->size);
+        AppendUInt64(data, item->mtime);
+      }
+    }
+
+    AppendUInt32(data, m_attributes.size());
+    for (std::map<std::string, CachedAttributes>::const_iterator cached = m_attributes.begin(); cached != m_attributes.end(); ++cached)
+    {
+      const Attributes& attributes = cached->second.attributes;
+      AppendString(data, cached->first);
+      AppendUInt32(data, attributes.flags);
+      AppendUInt32(data, attributes.permissions);
+      AppendUInt64(data, attributes.size);
+      AppendUInt64(data, attributes.mtime);
+      AppendUInt64(data, attributes.atime);
+    }
+
+    m_dirty = false;
+    m_lastSave = now;
+  }
+
+  // The folder may not exist yet on first use
+  XBMC->CreateDirectory(m_file.substr(0, m_file.find_last_of("/\\")).c_str());
+
+  std::string temporary = m_file + ".tmp";
+  FILE* file = fopen(temporary.c_str(), "wb");
+  if (!file)
+  {
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPMetadataCache: Failed to write snapshot '%s'", temporary.c_str());
+    return;
+  }
+
+  bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+  written &= fclose(file) == 0;
+#ifdef TARGET_WINDOWS
+  remove(m_file.c_str());
+#endif
+  if (!written || rename(temporary.c_str(), m_file.c_str()) != 0)
+  {
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPMetadataCache: Failed to replace snapshot '%s'", m_file.c_str());
+    remove(temporary.c_str());
+  }
+}
+
+/*!
+ \brief Reads the snapshot on first use, must be called with m_lock held.
+
+ Everything loaded counts as unconfirmed, so it's revalidated as soon as it is used.
+ */
+void CSFTPMetadataCache::Load()
+{
+  if (m_loaded)
+    return;
+  m_loaded = true;
+
+  if (m_file.empty())
+    return;
+
+  FILE* file = fopen(m_file.c_str(), "rb");
+  if (!file)
+    return;
+
+  std::string data;
+  char buffer[16384];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    data.append(buffer, length);
+  fclose(file);
+
+  uint32_t version, count;
+  std::string identity;
+  bool matches = data.compare(0, strlen(SFTP_SNAPSHOT_MAGIC), SFTP_SNAPSHOT_MAGIC) == 0;
+  if (matches)
+    data.erase(0, strlen(SFTP_SNAPSHOT_MAGIC));
+
+  CSnapshotReader reader(data);
+  if (!matches || !reader.ReadUInt32(version) || version != SFTP_SNAPSHOT_VERSION ||
+      !reader.ReadString(identity) || identity != m_identity || !reader.ReadUInt32(count))
+  {
+    XBMC->Log(ADDON::LOG_DEBUG, "SFTPMetadataCache: Ignoring outdated or foreign snapshot '%s'", m_file.c_str());
+    return;
+  }
+
+  bool complete = true;
+  for (uint32_t i = 0; i < count && complete; i++)
+  {
+    std::string folder;
+    Directory directory;
+    uint32_t items;
+    complete = reader.ReadString(folder) && reader.ReadInt64(directory.mtime) && reader.ReadUInt32(items);
+    for (uint32_t j = 0; j < items && complete; j++)
+    {
+      Item item;
+      uint32_t folderFlag;
+      complete = reader.ReadString(item.name) && reader.ReadUInt32(folderFlag) &&
+                 reader.ReadUInt64(item.size) && reader.ReadInt64(item.mtime);
+      item.folder = folderFlag != 0;
+      directory.items.push_back(item);
+    }
+
+    if (!complete)
+      break;
+
+    directory.checked = 0;
+    directory.charged = Footprint(folder, directory);
+    if (!Charge(directory.charged))
+      return;
+    m_directories[folder] = directory;
+  }
+
+  complete = complete && reader.ReadUInt32(count);
+  for (uint32_t i = 0; i < count && complete; i++)
+  {
+    std::string path;
+    CachedAttributes cached;
+    Attributes& attributes = cached.attributes;
+    complete = reader.ReadString(path) && reader.ReadUInt32(attributes.flags) && reader.ReadUInt32(attributes.permissions) &&
+               reader.ReadUInt64(attributes.size) && reader.ReadInt64(attributes.mtime) && reader.ReadInt64(attributes.atime);
+    if (!complete)
+      break;
+
+    cached.checked = 0;
+    cached.charged = Footprint(path);
+    if (!Charge(cached.charged))
+      return;
+    m_attributes[path] = cached;
+  }
+
+  if (!complete)
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPMetadataCache: Snapshot '%s' is truncated, using what was read", m_file.c_str());
+
+  XBMC->Log(ADDON::LOG_DEBUG, "SFTPMetadataCache: Loaded %u directories and %u attributes for '%s'",
+            (unsigned int)m_directories.size(), (unsigned int)m_attributes.size(), m_identity.c_str());
+}
+
+/*!
+ \brief Accounts \e bytes against the cache limit and the memory budget, must be called with m_lock held.
+ */
+bool CSFTPMetadataCache::Charge(size_t bytes)
+{
+  if (m_reserved + bytes > SFTP_METADATA_CACHE_SIZE || !CSFTPBufferPool::Get().Reserve(bytes))
+    return false;
+
+  m_reserved += bytes;
+  return true;
+}
+
+void CSFTPMetadataCache::Uncharge(size_t bytes)
+{
+  m_reserved -= bytes;
+  CSFTPBufferPool::Get().Unreserve(bytes);
+}
+
+bool CSFTPMetadataCache::IsStale(int64_t checked, int64_t now) const
+{
+  return checked == 0 || now - checked > SFTP_METADATA_REVALIDATE_MS;
+}
+
+size_t CSFTPMetadataCache::Footprint(const std::string& key, const Directory& directory)
+{
+  size_t bytes = key.size() + sizeof(Directory) + SFTP_METADATA_ENTRY_OVERHEAD;
+  for (std::vector<Item>::const_iterator item = directory.items.begin(); item != directory.items.end(); ++item)
+    bytes += sizeof(Item) + item->name.size();
+
+  return bytes;
+}
+
+size_t CSFTPMetadataCache::Footprint(const std::string& key)
+{
+  return key.size() + sizeof(CachedAttributes) + SFTP_METADATA_ENTRY_OVERHEAD;
+}
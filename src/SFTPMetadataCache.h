@@ -0,0 +1,116 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "platform/threads/mutex.h"
+#include "xbmc_addon_dll.h"
+#include "kodi_vfs_types.h"
+#include <boost/shared_ptr.hpp>
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+class CSFTPMetadataCache;
+typedef boost::shared_ptr<CSFTPMetadataCache> CSFTPMetadataCachePtr;
+
+/*!
+ \brief Directory listings and attributes of one host, kept across restarts in a snapshot file.
+
+ Entries are served as long as they exist. Those not confirmed by the server
+ recently, including everything loaded from the snapshot, are queued for
+ revalidation, which the session manager does in the background: a listing is
+ only fetched again if the directory's mtime changed. Memory is accounted in
+ CSFTPBufferPool, entries that don't fit are simply not cached. Caches live
+ until the add-on is unloaded.
+ */
+class CSFTPMetadataCache
+{
+public:
+  struct Item
+  {
+    std::string name;
+    bool folder;
+    uint64_t size;
+    int64_t mtime;
+  };
+
+  struct Attributes
+  {
+    uint32_t flags;
+    uint32_t permissions;
+    uint64_t size;
+    int64_t mtime;
+    int64_t atime;
+  };
+
+  static CSFTPMetadataCachePtr ForHost(const VFSURL* url);
+  static void SaveAll(bool force);
+
+  bool GetDirectory(const std::string& folder, std::vector<Item>& items);
+  void PutDirectory(const std::string& folder, int64_t mtime, const std::vector<Item>& items);
+  bool ConfirmDirectory(const std::string& folder, int64_t mtime);
+  bool GetAttributes(const std::string& path, Attributes& attributes);
+  void PutAttributes(const std::string& path, const Attributes& attributes);
+  void Remove(const std::string& path);
+
+  bool HasPending();
+  void TakePending(std::vector<std::string>& folders, std::vector<std::string>& paths);
+  void Save(bool force);
+private:
+  CSFTPMetadataCache(const std::string& identity, const std::string& file);
+  CSFTPMetadataCache& operator=(const CSFTPMetadataCache&);
+
+  struct Directory
+  {
+    int64_t mtime;
+    int64_t checked; // When the server last confirmed it, 0 if loaded from the snapshot
+    size_t charged;
+    std::vector<Item> items;
+  };
+
+  struct CachedAttributes
+  {
+    Attributes attributes;
+    int64_t checked;
+    size_t charged;
+  };
+
+  void Load();
+  bool Charge(size_t bytes);
+  void Uncharge(size_t bytes);
+  bool IsStale(int64_t checked, int64_t now) const;
+  static size_t Footprint(const std::string& key, const Directory& directory);
+  static size_t Footprint(const std::string& key);
+
+  PLATFORM::CMutex m_lock;
+  std::string m_identity;
+  std::string m_file;
+  bool m_loaded;
+  bool m_dirty;
+  int64_t m_lastSave;
+  size_t m_reserved;
+  std::map<std::string, Directory> m_directories;
+  std::map<std::string, CachedAttributes> m_attributes;
+  std::set<std::string> m_pendingFolders;
+  std::set<std::string> m_pendingPaths;
+};
@@ -0,0 +1,727 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "SFTPReadAhead.h"
+#include "SFTPBufferPool.h"
+#include "platform/util/timeutils.h"
+#include <algorithm>
+#include "libXBMC_addon.h"
+
+extern ADDON::CHelper_libXBMC_addon* XBMC;
+
+// Forward gaps smaller than this still count as sequential access, demuxers skip small ranges
+#define SFTP_SEQUENTIAL_GAP (2 * SFTP_READ_CHUNK_SIZE)
+
+// Sequential read-ahead in chunks, used until the player reports the stream bitrate
+#define SFTP_DEFAULT_PREFETCH_DEPTH 16
+#define SFTP_MIN_PREFETCH_DEPTH 2
+#define SFTP_MAX_PREFETCH_DEPTH 256
+
+// Seconds of playback sequential read-ahead covers once the bitrate is known
+#define SFTP_PREFETCH_SECONDS 2
+
+// Files modified this recently (in seconds, generous for clock skew) are followed as they grow
+#define SFTP_FOLLOW_RECENT_S 60
+// Size polling of a followed file backs off between these intervals while it doesn't grow
+#define SFTP_FOLLOW_POLL_MIN_MS 100
+#define SFTP_FOLLOW_POLL_MAX_MS 1000
+// Longest a read at the end of a followed file waits for more data before reporting end of file
+#define SFTP_FOLLOW_WAIT_MS 5000
+
+CSFTPAccessPattern::CSFTPAccessPattern()
+  : m_count(0), m_next(0), m_stride(0), m_mode(SEQUENTIAL)
+{
+}
+
+void CSFTPAccessPattern::Record(uint64_t position, size_t length)
+{
+  m_position[m_next] = position;
+  m_length[m_next] = length;
+  m_next = (m_next + 1) % HISTORY;
+  m_count++;
+
+  Classify();
+}
+
+/*!
+ \brief Classifies the recorded accesses by the gaps between consecutive ones.
+
+ Mostly gapless (or nearly gapless) accesses are sequential, repeating gaps are
+ strided and everything else is random. Until enough history exists the previous
+ mode is kept, which starts out as sequential since that is how most files are read.
+ */
+void CSFTPAccessPattern::Classify()
+{
+  int n = std::min(m_count, HISTORY);
+  int pairs = 0;
+  int sequential = 0;
+  int strided = 0;
+  int64_t stride = 0;
+
+  for (int i = 1; i < n; i++)
+  {
+    int current = (m_next - n + i + HISTORY) % HISTORY;
+    int previous = (current - 1 + HISTORY) % HISTORY;
+    int64_t gap = (int64_t)(m_position[current] - (m_position[previous] + m_length[previous]));
+
+    pairs++;
+    if (gap >= 0 && gap < SFTP_SEQUENTIAL_GAP)
+      sequential++;
+    else if (i > 1 && gap == stride)
+      strided++;
+    stride = gap;
+  }
+
+  m_stride = stride;
+  if (pairs < 2)
+    return;
+
+  if (sequential * 4 >= pairs * 3)
+    m_mode = SEQUENTIAL;
+  else if (strided * 2 >= pairs - 1)
+    m_mode = STRIDED;
+  else
+    m_mode = RANDOM;
+}
+
+/*!
+ \brief Returns the position the next access is expected at, following the detected stride if any.
+ */
+uint64_t CSFTPAccessPattern::PredictNext() const
+{
+  if (m_count == 0)
+    return 0;
+
+  int last = (m_next - 1 + HISTORY) % HISTORY;
+  uint64_t next = m_position[last] + m_length[last];
+  if (m_mode == STRIDED)
+    next += m_stride;
+
+  return next;
+}
+
+const char* CSFTPAccessPattern::ModeName(Mode mode)
+{
+  switch (mode)
+  {
+    case SEQUENTIAL:
+      return "sequential";
+    case STRIDED:
+      return "strided";
+    case RANDOM:
+      return "random";
+  }
+
+  return "unknown";
+}
+
+/*!
+ \brief Returns whether a file last modified at \e mtime is likely still being written, like a live recording.
+ */
+bool CSFTPReadAhead::IsGrowing(time_t mtime)
+{
+  return mtime + SFTP_FOLLOW_RECENT_S >= time(NULL);
+}
+
+/*!
+ \param size Size of the file, (uint64_t)-1 if unknown which leaves read-ahead unbounded.
+ \param mtime Modification time of the file, recently modified files are followed as they grow.
+ */
+CSFTPReadAhead::CSFTPReadAhead(CSFTPSessionPtr session, sftp_file handle, const std::string& file, uint64_t size, time_t mtime)
+  : m_session(session),
+    m_handle(handle),
+    m_file(file),
+    m_size(size),
+    m_position(0),
+    m_lastMode(CSFTPAccessPattern::SEQUENTIAL),
+    m_requestClass(SFTP_REQUEST_BULK),
+    m_depth(SFTP_DEFAULT_PREFETCH_DEPTH),
+    m_bitrate(0),
+    m_fetchRate(0),
+    m_rateStart(PLATFORM::GetTimeMs()),
+    m_rateBytes(0),
+    m_slabs(0),
+    m_follow(size != (uint64_t)-1 && IsGrowing(mtime)),
+    m_followBackoff(SFTP_FOLLOW_POLL_MIN_MS),
+    m_lastSizeCheck(PLATFORM::GetTimeMs()),
+    m_bytesRead(0),
+    m_bytesFetched(0)
+{
+  m_readsPerMode[CSFTPAccessPattern::SEQUENTIAL] = 0;
+  m_readsPerMode[CSFTPAccessPattern::STRIDED] = 0;
+  m_readsPerMode[CSFTPAccessPattern::RANDOM] = 0;
+
+  // Sized once so steady-state reading never reallocates them
+  m_requests.reserve(SFTP_MAX_PREFETCH_DEPTH);
+  m_blocks.reserve(32);
+  CSFTPBufferPool::Get().RegisterStream();
+
+  if (m_follow)
+    XBMC->Log(ADDON::LOG_DEBUG, "SFTPReadAhead: Following '%s' while it grows", m_file.c_str());
+}
+
+CSFTPReadAhead::~CSFTPReadAhead()
+{
+  while (!m_requests.empty())
+    Discard(m_requests.begin());
+  while (!m_blocks.empty())
+  {
+    CSFTPBufferPool::Get().ReleaseSlab(m_blocks.back().slab);
+    m_blocks.pop_back();
+  }
+  CSFTPBufferPool::Get().UnregisterStream();
+
+  XBMC->Log(ADDON::LOG_DEBUG, "SFTPReadAhead: '%s' read %llu bytes, fetched %llu bytes, reads sequential %llu strided %llu random %llu",
+            m_file.c_str(), (unsigned long long)m_bytesRead, (unsigned long long)m_bytesFetched,
+            (unsigned long long)m_readsPerMode[CSFTPAccessPattern::SEQUENTIAL],
+            (unsigned long long)m_readsPerMode[CSFTPAccessPattern::STRIDED],
+            (unsigned long long)m_readsPerMode[CSFTPAccessPattern::RANDOM]);
+}
+
+/*!
+ \brief Reads \e length bytes at the current position.
+ \param timeoutMs Longest time the read may wait on the server in ms, 0 waits without limit.
+ \return Returns the number of bytes read, or -1 on error or if nothing arrived in time.
+ */
+ssize_t CSFTPReadAhead::Read(void *buffer, size_t length, uint32_t timeoutMs)
+{
+  if (length == 0)
+    return 0;
+
+  PLATFORM::CTimeout deadline(timeoutMs);
+
+  m_pattern.Record(m_position, length);
+  CSFTPAccessPattern::Mode mode = m_pattern.GetMode();
+  if (mode != m_lastMode)
+  {
+    XBMC->Log(ADDON::LOG_DEBUG, "SFTPReadAhead: Access pattern for '%s' changed from %s to %s",
+              m_file.c_str(), CSFTPAccessPattern::ModeName(m_lastMode), CSFTPAccessPattern::ModeName(mode));
+    m_lastMode = mode;
+  }
+  m_readsPerMode[mode]++;
+
+  // Copies read straight through, anything else has someone waiting on it
+  if (mode != CSFTPAccessPattern::SEQUENTIAL)
+    SetInteractive();
+
+  DropStaleRequests();
+
+  char *data = (char*)buffer;
+  size_t copied = 0;
+  bool staleRetried = false;
+  while (copied < length)
+  {
+    size_t result = CopyFromBlocks(data + copied, length - copied);
+    if (result > 0)
+    {
+      copied += result;
+      m_position += result;
+      staleRetried = false;
+      continue;
+    }
+
+    std::vector<Request>::iterator request = FindRequest(m_position);
+    if (request == m_requests.end())
+    {
+      // Request everything still missing at once so a large read costs a single round trip. A
+      // followed file is only requested up to its known size, past that it has to grow first
+      uint64_t end = m_position + (length - copied);
+      if (m_follow)
+      {
+        end = std::min(end, m_size);
+        if (m_position >= end)
+        {
+          if (!WaitForGrowth(deadline, timeoutMs))
+            break;
+          staleRetried = false;
+          continue;
+        }
+      }
+
+      for (uint64_t position = m_position; position < end; position += SFTP_READ_CHUNK_SIZE)
+      {
+        if (FindRequest(position) == m_requests.end() && !Issue(position, SFTP_READ_CHUNK_SIZE, true, TimeLeft(deadline, timeoutMs)))
+          break;
+      }
+
+      // Without a request for the current position the session timed out or the connection is gone
+      request = FindRequest(m_position);
+      if (request == m_requests.end())
+      {
+        XBMC->Log(ADDON::LOG_ERROR, "SFTPReadAhead: Failed to request '%s' at %llu", m_file.c_str(), (unsigned long long)m_position);
+        if (copied == 0)
+          return -1;
+        break;
+      }
+    }
+
+    int received = Complete(request, TimeLeft(deadline, timeoutMs));
+    if (received < 0)
+    {
+      XBMC->Log(ADDON::LOG_ERROR, "SFTPReadAhead: Failed to read '%s' at %llu", m_file.c_str(), (unsigned long long)m_position);
+      return copied > 0 ? (ssize_t)copied : -1;
+    }
+    else if (received == 0)
+    {
+      // The file grew after the request was sent, its end of file reply is stale. Asking once
+      // more is enough, a file that really ends before its size was truncated
+      if (m_position < m_size && !staleRetried)
+      {
+        staleRetried = true;
+        continue;
+      }
+
+      if (!WaitForGrowth(deadline, timeoutMs))
+        break;
+      staleRetried = false;
+    }
+  }
+
+  // Keep read-ahead going near the end of a file that is still being written
+  if (m_follow && m_position + GetPrefetchDepth() * SFTP_READ_CHUNK_SIZE >= m_size &&
+      PLATFORM::GetTimeMs() - m_lastSizeCheck >= m_followBackoff)
+    RefreshSize(TimeLeft(deadline, timeoutMs));
+
+  m_bytesRead += copied;
+  Prefetch(length, TimeLeft(deadline, timeoutMs));
+  TrimBlocks();
+  if (CSFTPBufferPool::Get().IsUnderPressure())
+    ReleaseToFairShare();
+
+  return copied;
+}
+
+/*!
+ \brief Moves to \e position, abandoning requests it makes useless and requesting the new position right away.
+ \param timeoutMs Longest time to wait for the session in ms, 0 waits without limit. If it passes the
+        position is only requested by the next Read().
+
+ Abandoned replies are never waited for, so seeking costs about one round trip
+ however many requests were outstanding.
+ */
+int64_t CSFTPReadAhead::Seek(uint64_t position, uint32_t timeoutMs)
+{
+  SetInteractive();
+  m_position = position;
+  DropStaleRequests();
+
+  if (m_pattern.GetMode() == CSFTPAccessPattern::SEQUENTIAL)
+    Prefetch(0, timeoutMs);
+  else if (!IsBuffered(m_position) && FindRequest(m_position) == m_requests.end())
+    Issue(m_position, SFTP_READ_CHUNK_SIZE, true, timeoutMs);
+
+  return m_position;
+}
+
+/*!
+ \brief Schedules reads for a player instead of a bulk transfer.
+
+ Readers start out as bulk transfers and are promoted once they seek, read
+ non-sequentially or are probed by a player through IoControl.
+ */
+void CSFTPReadAhead::SetInteractive()
+{
+  m_requestClass = SFTP_REQUEST_PLAYBACK;
+}
+
+/*!
+ \brief Sizes sequential read-ahead to cover a fixed playback time at the stream's bitrate.
+ \param bytesPerSecond Bitrate reported by the player, 0 to go back to the default depth.
+ */
+void CSFTPReadAhead::SetBitrate(unsigned int bytesPerSecond)
+{
+  m_bitrate = bytesPerSecond;
+  if (bytesPerSecond == 0)
+    m_depth = SFTP_DEFAULT_PREFETCH_DEPTH;
+  else
+  {
+    uint64_t depth = (uint64_t)bytesPerSecond * SFTP_PREFETCH_SECONDS / SFTP_READ_CHUNK_SIZE + 1;
+    m_depth = (unsigned int)std::max((uint64_t)SFTP_MIN_PREFETCH_DEPTH, std::min((uint64_t)SFTP_MAX_PREFETCH_DEPTH, depth));
+  }
+
+  XBMC->Log(ADDON::LOG_DEBUG, "SFTPReadAhead: Bitrate of '%s' is %u bytes/s, reading ahead %u chunks",
+            m_file.c_str(), bytesPerSecond, m_depth);
+}
+
+/*!
+ \brief Returns how many bytes following the current position are received or requested without a gap.
+
+ Replies are only taken off the session when they are read, so data still in
+ flight counts as well. Otherwise no more than the current block would show.
+ */
+uint64_t CSFTPReadAhead::GetBufferedAhead() const
+{
+  return GetContiguousEnd() - m_position;
+}
+
+/*!
+ \brief Returns the end of the run of received and requested data that starts at the current position.
+ */
+uint64_t CSFTPReadAhead::GetContiguousEnd() const
+{
+  uint64_t end = m_position;
+  bool extended = true;
+  while (extended)
+  {
+    extended = false;
+    for (std::vector<Block>::const_iterator block = m_blocks.begin(); block != m_blocks.end() && !extended; ++block)
+    {
+      if (block->position <= end && end < block->position + block->size)
+      {
+        end = block->position + block->size;
+        extended = true;
+      }
+    }
+
+    for (std::vector<Request>::const_iterator request = m_requests.begin(); request != m_requests.end() && !extended; ++request)
+    {
+      if (request->position <= end && end < request->position + request->length)
+      {
+        end = request->position + request->length;
+        extended = true;
+      }
+    }
+  }
+
+  return end;
+}
+
+void CSFTPReadAhead::UpdateFetchRate(size_t bytes)
+{
+  m_rateBytes += bytes;
+  int64_t now = PLATFORM::GetTimeMs();
+  int64_t elapsed = now - m_rateStart;
+  if (elapsed >= 1000)
+  {
+    m_fetchRate = (unsigned int)(m_rateBytes * 1000 / elapsed);
+    m_rateBytes = 0;
+    m_rateStart = now;
+  }
+}
+
+bool CSFTPReadAhead::IsBuffered(uint64_t position) const
+{
+  for (std::vector<Block>::const_iterator block = m_blocks.begin(); block != m_blocks.end(); ++block)
+  {
+    if (block->position <= position && position < block->position + block->size)
+      return true;
+  }
+
+  return false;
+}
+
+size_t CSFTPReadAhead::CopyFromBlocks(char *buffer, size_t length)
+{
+  for (std::vector<Block>::iterator block = m_blocks.begin(); block != m_blocks.end(); ++block)
+  {
+    if (block->position <= m_position && m_position < block->position + block->size)
+    {
+      size_t offset = m_position - block->position;
+      size_t count = std::min(length, block->size - offset);
+      memcpy(buffer, block->slab + offset, count);
+
+      // Keep the most recently used block at the back, trimming starts at the front
+      std::rotate(block, block + 1, m_blocks.end());
+      return count;
+    }
+  }
+
+  return 0;
+}
+
+std::vector<CSFTPReadAhead::Request>::iterator CSFTPReadAhead::FindRequest(uint64_t position)
+{
+  std::vector<Request>::iterator request = m_requests.begin();
+  for (; request != m_requests.end(); ++request)
+  {
+    if (request->position <= position && position < request->position + request->length)
+      break;
+  }
+
+  return request;
+}
+
+/*!
+ \brief Sends a read request for \e length bytes (at most SFTP_READ_CHUNK_SIZE) at \e position.
+ \param demand \e true if the caller is waiting on the data, speculative requests stay within the
+        stream's fair share of the memory budget.
+ \param timeoutMs Longest time to wait for the session in ms, 0 waits without limit.
+ */
+bool CSFTPReadAhead::Issue(uint64_t position, uint32_t length, bool demand, uint32_t timeoutMs)
+{
+  CSFTPBufferPool& pool = CSFTPBufferPool::Get();
+  if (!demand && (m_slabs + 1) * SFTP_READ_CHUNK_SIZE > pool.GetFairShare())
+    return false;
+
+  char *slab = pool.AcquireSlab(demand);
+  if (!slab)
+    return false;
+
+  int id = m_session->BeginRead(m_handle, position, length, m_requestClass, timeoutMs);
+  if (id < 0)
+  {
+    pool.ReleaseSlab(slab);
+    return false;
+  }
+
+  Request request;
+  request.position = position;
+  request.length = length;
+  request.id = id;
+  request.slab = slab;
+  m_requests.push_back(request);
+  m_slabs++;
+  return true;
+}
+
+/*!
+ \brief Waits for the reply to \e request and keeps its data as a block.
+ \return Returns the number of bytes received, 0 at end of file or -1 on error or timeout. A
+         request that timed out has been abandoned by the session, only its slab is left to release.
+ */
+int CSFTPReadAhead::Complete(std::vector<Request>::iterator request, uint32_t timeoutMs)
+{
+  Block block;
+  block.position = request->position;
+  block.size = 0;
+  block.slab = request->slab;
+
+  int result = m_session->EndRead(m_handle, request->id, block.slab, request->length, m_requestClass, timeoutMs);
+  m_requests.erase(request);
+  if (result <= 0)
+  {
+    CSFTPBufferPool::Get().ReleaseSlab(block.slab);
+    m_slabs--;
+    return result;
+  }
+
+  block.size = result;
+  m_blocks.push_back(block);
+  m_bytesFetched += result;
+  UpdateFetchRate(result);
+  return result;
+}
+
+/*!
+ \brief Returns what is left of \e timeoutMs, at least 1 ms once it ran out so waits fail fast
+        instead of becoming unbounded.
+ */
+uint32_t CSFTPReadAhead::TimeLeft(const PLATFORM::CTimeout& deadline, uint32_t timeoutMs)
+{
+  if (timeoutMs == 0)
+    return 0;
+
+  uint32_t left = deadline.TimeLeft();
+  return left > 0 ? left : 1;
+}
+
+void CSFTPReadAhead::Discard(std::vector<Request>::iterator request)
+{
+  // The session drops the reply into its own scratch space, the slab can be reused right away
+  m_session->AbandonRead(request->id);
+  CSFTPBufferPool::Get().ReleaseSlab(request->slab);
+  m_slabs--;
+  m_requests.erase(request);
+}
+
+/*!
+ \brief Discards outstanding requests outside the window the current position can still use.
+ */
+void CSFTPReadAhead::DropStaleRequests()
+{
+  uint64_t windowEnd = m_position + (uint64_t)(GetPrefetchDepth() + 1) * SFTP_READ_CHUNK_SIZE;
+  if (m_pattern.GetMode() == CSFTPAccessPattern::STRIDED)
+    windowEnd = std::max(windowEnd, m_pattern.PredictNext() + SFTP_READ_CHUNK_SIZE);
+
+  for (std::vector<Request>::iterator request = m_requests.begin(); request != m_requests.end();)
+  {
+    if (request->position + request->length <= m_position || request->position >= windowEnd)
+    {
+      Discard(request);
+      request = m_requests.begin();
+    }
+    else
+      ++request;
+  }
+}
+
+/*!
+ \brief Sends requests for the data the detected access pattern will most likely ask for next.
+ \param lastLength Length of the read just served, used as the size of the next strided access.
+ \param timeoutMs Longest time each request may wait for the session in ms, 0 waits without limit.
+ */
+void CSFTPReadAhead::Prefetch(size_t lastLength, uint32_t timeoutMs)
+{
+  unsigned int depth = GetPrefetchDepth();
+  CSFTPAccessPattern::Mode mode = m_pattern.GetMode();
+
+  if (mode == CSFTPAccessPattern::SEQUENTIAL)
+  {
+    // Extend the run of buffered and requested data that starts at the current position
+    uint64_t end = GetContiguousEnd();
+    while (m_requests.size() < depth && end < m_size && Issue(end, SFTP_READ_CHUNK_SIZE, false, timeoutMs))
+      end += SFTP_READ_CHUNK_SIZE;
+  }
+  else if (mode == CSFTPAccessPattern::STRIDED)
+  {
+    uint64_t next = m_pattern.PredictNext();
+    uint64_t end = std::min(next + lastLength, m_size);
+    for (uint64_t position = next; position < end && m_requests.size() < depth; position += SFTP_READ_CHUNK_SIZE)
+    {
+      if (FindRequest(position) == m_requests.end() && !Issue(position, SFTP_READ_CHUNK_SIZE, false, timeoutMs))
+        break;
+    }
+  }
+}
+
+/*!
+ \brief Picks up the current size of a followed file, stopping to follow once it is no longer written.
+ \param timeoutMs Longest time to wait for the session in ms, never more than SFTP_FOLLOW_WAIT_MS.
+ \return Returns \e true if the file grew.
+ */
+bool CSFTPReadAhead::RefreshSize(uint32_t timeoutMs)
+{
+  m_lastSizeCheck = PLATFORM::GetTimeMs();
+  struct __stat64 buffer;
+  uint32_t waitMs = SFTP_FOLLOW_WAIT_MS;
+  if (timeoutMs > 0)
+    waitMs = std::min(waitMs, timeoutMs);
+  if (m_session->FStat(m_handle, &buffer, waitMs) != 0)
+    return false;
+
+  if ((uint64_t)buffer.st_size > m_size)
+  {
+    m_size = buffer.st_size;
+    m_followBackoff = SFTP_FOLLOW_POLL_MIN_MS;
+    return true;
+  }
+
+  if (!IsGrowing(buffer.st_mtime))
+  {
+    XBMC->Log(ADDON::LOG_DEBUG, "SFTPReadAhead: '%s' stopped growing at %llu bytes", m_file.c_str(), (unsigned long long)m_size);
+    m_follow = false;
+  }
+
+  m_followBackoff = std::min(m_followBackoff * 2, (uint32_t)SFTP_FOLLOW_POLL_MAX_MS);
+  return false;
+}
+
+/*!
+ \brief Waits at the end of a followed file until it grows, polling its size with backoff.
+ \return Returns \e false if the file isn't followed or didn't grow in time, which means end of file.
+ */
+bool CSFTPReadAhead::WaitForGrowth(const PLATFORM::CTimeout& deadline, uint32_t timeoutMs)
+{
+  // Half of the read deadline at most, a read at the end should report end of file rather than fail
+  uint32_t limit = SFTP_FOLLOW_WAIT_MS;
+  if (timeoutMs > 0)
+    limit = std::min(limit, deadline.TimeLeft() / 2);
+
+  int64_t start = PLATFORM::GetTimeMs();
+  while (m_follow)
+  {
+    if (RefreshSize(TimeLeft(deadline, timeoutMs)))
+      return true;
+
+    if (!m_follow || PLATFORM::GetTimeMs() - start + m_followBackoff > limit)
+      break;
+    m_followWait.Wait(m_followBackoff);
+  }
+
+  return false;
+}
+
+void CSFTPReadAhead::TrimBlocks()
+{
+  size_t retained = GetRetainedBlocks();
+  while (m_blocks.size() > retained)
+  {
+    CSFTPBufferPool::Get().ReleaseSlab(m_blocks.front().slab);
+    m_slabs--;
+    m_blocks.erase(m_blocks.begin());
+  }
+}
+
+/*!
+ \brief Gives memory back while the pool is under pressure, retained blocks first, then the
+        requests furthest ahead, until this stream is within its fair share.
+ */
+void CSFTPReadAhead::ReleaseToFairShare()
+{
+  size_t share = CSFTPBufferPool::Get().GetFairShare() / SFTP_READ_CHUNK_SIZE;
+
+  for (std::vector<Block>::iterator block = m_blocks.begin(); m_slabs > share && block != m_blocks.end();)
+  {
+    if (block->position <= m_position && m_position < block->position + block->size)
+      ++block;
+    else
+    {
+      CSFTPBufferPool::Get().ReleaseSlab(block->slab);
+      m_slabs--;
+      block = m_blocks.erase(block);
+    }
+  }
+
+  while (m_slabs > share && m_requests.size() > 1)
+  {
+    std::vector<Request>::iterator furthest = m_requests.begin();
+    for (std::vector<Request>::iterator request = m_requests.begin(); request != m_requests.end(); ++request)
+    {
+      if (request->position > furthest->position)
+        furthest = request;
+    }
+    Discard(furthest);
+  }
+}
+
+/*!
+ \brief Returns how many read requests may be outstanding for the detected access pattern.
+ */
+unsigned int CSFTPReadAhead::GetPrefetchDepth() const
+{
+  switch (m_pattern.GetMode())
+  {
+    case CSFTPAccessPattern::SEQUENTIAL:
+      return m_depth;
+    case CSFTPAccessPattern::STRIDED:
+      return std::min(4u, m_depth);
+    default:
+      return 0;
+  }
+}
+
+/*!
+ \brief Returns how many received blocks are kept for the detected access pattern.
+
+ Sequential readers never come back, random readers (archive and container
+ indexes) often revisit what they just read.
+ */
+size_t CSFTPReadAhead::GetRetainedBlocks() const
+{
+  switch (m_pattern.GetMode())
+  {
+    case CSFTPAccessPattern::SEQUENTIAL:
+      return 2;
+    case CSFTPAccessPattern::STRIDED:
+      return 4;
+    default:
+      return 16;
+  }
+}
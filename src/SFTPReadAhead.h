@@ -0,0 +1,132 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "SFTPSession.h"
+#include "platform/util/timeutils.h"
+#include <time.h>
+#include <string>
+#include <vector>
+
+class CSFTPAccessPattern
+{
+public:
+  enum Mode
+  {
+    SEQUENTIAL,
+    STRIDED,
+    RANDOM
+  };
+
+  CSFTPAccessPattern();
+
+  void Record(uint64_t position, size_t length);
+  Mode GetMode() const { return m_mode; }
+  uint64_t PredictNext() const;
+  static const char* ModeName(Mode mode);
+private:
+  void Classify();
+
+  static const int HISTORY = 8;
+  uint64_t m_position[HISTORY];
+  size_t m_length[HISTORY];
+  int m_count;
+  int m_next;
+  int64_t m_stride;
+  Mode m_mode;
+};
+
+class CSFTPReadAhead
+{
+public:
+  CSFTPReadAhead(CSFTPSessionPtr session, sftp_file handle, const std::string& file, uint64_t size, time_t mtime);
+  ~CSFTPReadAhead();
+
+  static bool IsGrowing(time_t mtime);
+
+  ssize_t Read(void *buffer, size_t length, uint32_t timeoutMs = 0);
+  int64_t Seek(uint64_t position, uint32_t timeoutMs = 0);
+  int64_t GetPosition() const { return m_position; }
+  uint64_t GetSize() const { return m_size; }
+  void SetInteractive();
+  void SetBitrate(unsigned int bytesPerSecond);
+  uint64_t GetBufferedAhead() const;
+  unsigned int GetBitrate() const { return m_bitrate; }
+  unsigned int GetFetchRate() const { return m_fetchRate; }
+private:
+  // Each request owns the pooled slab its reply is received into, which then becomes a block
+  struct Request
+  {
+    uint64_t position;
+    uint32_t length;
+    int id;
+    char *slab;
+  };
+
+  struct Block
+  {
+    uint64_t position;
+    size_t size;
+    char *slab;
+  };
+
+  size_t CopyFromBlocks(char *buffer, size_t length);
+  bool IsBuffered(uint64_t position) const;
+  uint64_t GetContiguousEnd() const;
+  std::vector<Request>::iterator FindRequest(uint64_t position);
+  bool Issue(uint64_t position, uint32_t length, bool demand, uint32_t timeoutMs = 0);
+  int Complete(std::vector<Request>::iterator request, uint32_t timeoutMs = 0);
+  static uint32_t TimeLeft(const PLATFORM::CTimeout& deadline, uint32_t timeoutMs);
+  void Discard(std::vector<Request>::iterator request);
+  void DropStaleRequests();
+  void Prefetch(size_t lastLength, uint32_t timeoutMs);
+  void TrimBlocks();
+  void ReleaseToFairShare();
+  void UpdateFetchRate(size_t bytes);
+  bool RefreshSize(uint32_t timeoutMs);
+  bool WaitForGrowth(const PLATFORM::CTimeout& deadline, uint32_t timeoutMs);
+  unsigned int GetPrefetchDepth() const;
+  size_t GetRetainedBlocks() const;
+
+  CSFTPSessionPtr m_session;
+  sftp_file m_handle;
+  std::string m_file;
+  uint64_t m_size;
+  uint64_t m_position;
+  std::vector<Request> m_requests;
+  std::vector<Block> m_blocks;
+  CSFTPAccessPattern m_pattern;
+  CSFTPAccessPattern::Mode m_lastMode;
+  SFTPRequestClass m_requestClass;
+  unsigned int m_depth;
+  unsigned int m_bitrate;
+  unsigned int m_fetchRate;
+  int64_t m_rateStart;
+  uint64_t m_rateBytes;
+  uint64_t m_readsPerMode[3];
+  size_t m_slabs;
+  bool m_follow;
+  uint32_t m_followBackoff;
+  int64_t m_lastSizeCheck;
+  PLATFORM::CEvent m_followWait;
+  uint64_t m_bytesRead;
+  uint64_t m_bytesFetched;
+};
@@ -0,0 +1,187 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "SFTPScheduler.h"
+#include "SFTPTrace.h"
+#include "platform/util/timeutils.h"
+#include <algorithm>
+
+// Length of the window session time shares are accounted over
+#define SFTP_SHARE_WINDOW_MS 1000
+
+// How often a waiting class may be passed over by higher ones before it goes first
+static const unsigned int PassOverLimit[SFTP_REQUEST_CLASSES] = { 0, 8, 16 };
+
+// Percentage of the session time a class may use while a higher class is active,
+// copies may not take more than half of the session while anything else uses it
+static const unsigned int TimeShare[SFTP_REQUEST_CLASSES] = { 100, 100, 50 };
+
+CSFTPScheduler::CSFTPScheduler()
+  : m_busy(false),
+    m_owner(SFTP_REQUEST_PLAYBACK),
+    m_grantTime(0),
+    m_windowStart(PLATFORM::GetTimeMs())
+{
+  for (int i = 0; i < SFTP_REQUEST_CLASSES; i++)
+  {
+    m_waiting[i] = 0;
+    m_passedOver[i] = 0;
+    m_usedMs[i] = 0;
+    m_lastActive[i] = 0;
+  }
+}
+
+/*!
+ \brief Waits until \e requestClass may use the session.
+ \param timeoutMs Longest time to wait in ms, 0 waits without limit.
+ \return Returns \e true if the session was granted, \e false if the timeout passed first.
+ */
+bool CSFTPScheduler::Acquire(SFTPRequestClass requestClass, uint32_t timeoutMs)
+{
+  PLATFORM::CLockObject lock(m_mutex);
+  PLATFORM::CTimeout deadline(timeoutMs);
+  m_waiting[requestClass]++;
+
+  uint32_t retryIn = 0;
+  while (!IsTurn(requestClass, PLATFORM::GetTimeMs(), retryIn))
+  {
+    if (timeoutMs > 0)
+    {
+      uint32_t left = deadline.TimeLeft();
+      if (left == 0)
+      {
+        // Classes below may have been waiting for this one to go
+        m_waiting[requestClass]--;
+        m_condition.Broadcast();
+        return false;
+      }
+      retryIn = retryIn > 0 ? std::min(retryIn, left) : left;
+    }
+    m_condition.Wait(m_mutex, retryIn);
+  }
+
+  m_waiting[requestClass]--;
+  for (int i = requestClass + 1; i < SFTP_REQUEST_CLASSES; i++)
+  {
+    if (m_waiting[i] > 0)
+      m_passedOver[i]++;
+  }
+  m_passedOver[requestClass] = 0;
+
+  m_busy = true;
+  m_owner = requestClass;
+  m_grantTime = PLATFORM::GetTimeMs();
+  m_lastActive[requestClass] = m_grantTime;
+  return true;
+}
+
+void CSFTPScheduler::Release()
+{
+  PLATFORM::CLockObject lock(m_mutex);
+  int64_t now = PLATFORM::GetTimeMs();
+  RollWindow(now);
+  m_usedMs[m_owner] += now - m_grantTime;
+  m_lastActive[m_owner] = now;
+  m_busy = false;
+  m_condition.Broadcast();
+}
+
+/*!
+ \brief Decides whether \e requestClass may take the session now, must be called with m_mutex held.
+ \param retryIn Set to the time in ms after which waiting should be re-evaluated, 0 to wait for a release.
+ */
+bool CSFTPScheduler::IsTurn(SFTPRequestClass requestClass, int64_t now, uint32_t& retryIn)
+{
+  retryIn = 0;
+  if (m_busy)
+    return false;
+
+  for (int i = 0; i < requestClass; i++)
+  {
+    if (m_waiting[i] > 0 && m_passedOver[requestClass] < PassOverLimit[requestClass])
+      return false;
+  }
+
+  RollWindow(now);
+  if (TimeShare[requestClass] < 100)
+  {
+    bool higherActive = false;
+    for (int i = 0; i < requestClass; i++)
+      higherActive |= now - m_lastActive[i] < SFTP_SHARE_WINDOW_MS;
+
+    if (higherActive && m_usedMs[requestClass] * 100 >= (int64_t)TimeShare[requestClass] * SFTP_SHARE_WINDOW_MS)
+    {
+      retryIn = (uint32_t)(m_windowStart + SFTP_SHARE_WINDOW_MS - now) + 1;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void CSFTPScheduler::RollWindow(int64_t now)
+{
+  if (now - m_windowStart < SFTP_SHARE_WINDOW_MS)
+    return;
+
+  m_windowStart = now;
+  for (int i = 0; i < SFTP_REQUEST_CLASSES; i++)
+    m_usedMs[i] = 0;
+}
+
+CSFTPScheduledLock::CSFTPScheduledLock(CSFTPScheduler& scheduler, SFTPRequestClass requestClass, uint32_t timeoutMs,
+                                       CSFTPTraceSpan* span)
+  : m_scheduler(scheduler),
+    m_requestClass(requestClass),
+    m_span(span && span->IsActive() ? span : NULL),
+    m_locked(false)
+{
+  int64_t start = m_span ? CSFTPTrace::Now() : 0;
+  m_locked = m_scheduler.Acquire(m_requestClass, timeoutMs);
+  if (m_span)
+    m_span->AddLockWait(CSFTPTrace::Now() - start);
+}
+
+CSFTPScheduledLock::~CSFTPScheduledLock()
+{
+  Unlock();
+}
+
+bool CSFTPScheduledLock::Lock(uint32_t timeoutMs)
+{
+  if (!m_locked)
+  {
+    int64_t start = m_span ? CSFTPTrace::Now() : 0;
+    m_locked = m_scheduler.Acquire(m_requestClass, timeoutMs);
+    if (m_span)
+      m_span->AddLockWait(CSFTPTrace::Now() - start);
+  }
+
+  return m_locked;
+}
+
+void CSFTPScheduledLock::Unlock()
+{
+  if (m_locked)
+  {
+    m_scheduler.Release();
+    m_locked = false;
+  }
+}
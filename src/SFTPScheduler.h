@@ -0,0 +1,90 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "platform/threads/mutex.h"
+#include <stddef.h>
+#include <stdint.h>
+
+class CSFTPTraceSpan;
+
+enum SFTPRequestClass
+{
+  SFTP_REQUEST_PLAYBACK = 0,  // Reads a player is waiting on
+  SFTP_REQUEST_METADATA,      // Stat, listings and small files the UI is waiting on
+  SFTP_REQUEST_BULK,          // Copies and other long sequential transfers
+  SFTP_REQUEST_CLASSES
+};
+
+/*!
+ \brief Serializes access to one SSH session, granting it by request class instead of arrival order.
+
+ A waiting class is served before every lower one. To keep lower classes from
+ starving they are let through after being passed over a number of times. Bulk
+ transfers are limited to a fixed half of the session time while a higher class
+ is active.
+ */
+class CSFTPScheduler
+{
+public:
+  CSFTPScheduler();
+
+  bool Acquire(SFTPRequestClass requestClass, uint32_t timeoutMs = 0);
+  void Release();
+private:
+  bool IsTurn(SFTPRequestClass requestClass, int64_t now, uint32_t& retryIn);
+  void RollWindow(int64_t now);
+
+  PLATFORM::CMutex m_mutex;
+  PLATFORM::CCondition<bool> m_condition;
+  bool m_busy;
+  SFTPRequestClass m_owner;
+  int64_t m_grantTime;
+  int64_t m_windowStart;
+  unsigned int m_waiting[SFTP_REQUEST_CLASSES];
+  unsigned int m_passedOver[SFTP_REQUEST_CLASSES];
+  int64_t m_usedMs[SFTP_REQUEST_CLASSES];
+  int64_t m_lastActive[SFTP_REQUEST_CLASSES];
+};
+
+/*!
+ \brief Scoped access to a scheduled session, used like PLATFORM::CLockObject.
+
+ The acquisition is bounded by \e timeoutMs, check IsLocked() after construction.
+ Lock() after an Unlock() takes its own timeout and returns whether it succeeded.
+ Time spent waiting is added to \e span if one is given.
+ */
+class CSFTPScheduledLock
+{
+public:
+  CSFTPScheduledLock(CSFTPScheduler& scheduler, SFTPRequestClass requestClass, uint32_t timeoutMs = 0,
+                     CSFTPTraceSpan* span = NULL);
+  ~CSFTPScheduledLock();
+
+  bool IsLocked() const { return m_locked; }
+  bool Lock(uint32_t timeoutMs = 0);
+  void Unlock();
+private:
+  CSFTPScheduler& m_scheduler;
+  SFTPRequestClass m_requestClass;
+  CSFTPTraceSpan* m_span;
+  bool m_locked;
+};
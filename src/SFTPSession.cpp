@@ -19,26 +19,32 @@
  */
 
 #include "SFTPSession.h"
+#include "SFTPBufferPool.h"
+#include "SFTPConnector.h"
+#include "SFTPDirectory.h"
+#include "SFTPKnownHosts.h"
+#include "SFTPTrace.h"
 #include "platform/util/timeutils.h"
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sstream>
+#include <algorithm>
 #include "libXBMC_addon.h"
 
 extern ADDON::CHelper_libXBMC_addon* XBMC;
 
 #define SFTP_TIMEOUT 5
 
-static std::string CorrectPath(const std::string& path)
-{
-  if (path == "~")
-    return "./";
-  else if (path.substr(0, 2) == "~/")
-    return "./" + path.substr(2);
-  else
-    return "/" + path;
-}
+// Sessions unused for this long are torn down by the maintenance thread
+#define SFTP_IDLE_TIMEOUT_MS 90000
+// Quiet sessions send an SSH ignore message this often to keep NAT and firewall state alive
+#define SFTP_KEEPALIVE_INTERVAL_MS 30000
+#define SFTP_MAINTENANCE_INTERVAL_MS 10000
+
+// How often a read waiting for its deadline checks the channel for the reply
+#define SFTP_READ_POLL_MS 100
+// Longest a close waits for the replies to outstanding reads before leaving it to the maintenance thread
+#define SFTP_CLOSE_DRAIN_MS 1000
 
 static const char * SFTPErrorText(int sftp_error)
 {
@@ -78,29 +84,94 @@ static const char * SFTPErrorText(int sftp_error)
   return "Unknown error code";
 }
 
+static CSFTPMetadataCache::Attributes ToCachedAttributes(sftp_attributes attributes)
+{
+  CSFTPMetadataCache::Attributes cached;
+  cached.flags = attributes->flags;
+  cached.permissions = attributes->permissions;
+  cached.size = attributes->size;
+  cached.mtime = attributes->mtime;
+  cached.atime = attributes->atime;
+  return cached;
+}
+
+static void AttributesToStat(const CSFTPMetadataCache::Attributes& attributes, struct __stat64* buffer)
+{
+  memset(buffer, 0, sizeof(struct __stat64));
+  buffer->st_size = attributes.size;
+  buffer->st_mtime = attributes.mtime;
+  buffer->st_atime = attributes.atime;
+
+  if S_ISDIR(attributes.permissions)
+    buffer->st_mode = S_IFDIR;
+  else if S_ISREG(attributes.permissions)
+    buffer->st_mode = S_IFREG;
+}
+
+static int AsyncRead(sftp_file handle, void *buffer, uint32_t length, uint32_t id)
+{
+  // After an end of file reply libssh answers every later read on the handle with 0
+  // without consuming its reply, seeking clears that state without moving the handle
+  sftp_seek64(handle, sftp_tell64(handle));
+  int result = sftp_async_read(handle, buffer, length, id);
+  return result == SSH_EOF ? 0 : result;
+}
+
+// Returns what is left of timeoutMs, at least 1 ms once it ran out so waits fail fast instead of becoming unbounded
+static uint32_t TimeLeft(const PLATFORM::CTimeout& deadline, uint32_t timeoutMs)
+{
+  if (timeoutMs == 0)
+    return 0;
+
+  uint32_t left = deadline.TimeLeft();
+  return left > 0 ? left : 1;
+}
+
 CSFTPSession::CSFTPSession(VFSURL* url)
 {
   XBMC->Log(ADDON::LOG_INFO, "SFTPSession: Creating new session on host '%s:%d' with user '%s'", url->hostname, url->port, url->username);
-  PLATFORM::CLockObject lock(m_lock);
+  m_cache = CSFTPMetadataCache::ForHost(url);
+  CSFTPScheduledLock lock(m_scheduler, SFTP_REQUEST_METADATA);
   if (!Connect(url))
     Disconnect();
 
   m_LastActive = PLATFORM::GetTimeMs();
+  m_LastKeepAlive = m_LastActive;
 }
 
 CSFTPSession::~CSFTPSession()
 {
-  PLATFORM::CLockObject lock(m_lock);
+  CSFTPScheduledLock lock(m_scheduler, SFTP_REQUEST_METADATA);
+  PLATFORM::CLockObject closingLock(m_closingLock);
+  for (std::set<sftp_file>::iterator it = m_closing.begin(); it != m_closing.end(); ++it)
+    sftp_close(*it);
+  m_closing.clear();
+  for (size_t i = 0; i < m_closingDirs.size(); i++)
+    sftp_closedir(m_closingDirs[i]);
+  m_closingDirs.clear();
   Disconnect();
+
+  PLATFORM::CLockObject readsLock(m_readsLock);
+  for (std::map<int, ReceivedRead>::iterator it = m_received.begin(); it != m_received.end(); ++it)
+    CSFTPBufferPool::Get().ReleaseSlab(it->second.data);
 }
 
-sftp_file CSFTPSession::CreateFileHande(const std::string& file)
+sftp_file CSFTPSession::CreateFileHande(const std::string& file, uint32_t timeoutMs)
 {
+  PLATFORM::CTimeout deadline(timeoutMs);
+  CSFTPTraceSpan span("Open");
+  span.SetPath(file.c_str());
   if (m_connected)
   {
-    PLATFORM::CLockObject lock(m_lock);
+    CSFTPScheduledLock lock(m_scheduler, SFTP_REQUEST_METADATA, timeoutMs, &span);
+    if (!lock.IsLocked() || !ReceiveOutstanding(TimeLeft(deadline, timeoutMs)))
+    {
+      XBMC->Log(ADDON::LOG_ERROR, "SFTPSession: Timed out waiting to open '%s'", file.c_str());
+      return NULL;
+    }
+
     m_LastActive = PLATFORM::GetTimeMs();
-    sftp_file handle = sftp_open(m_sftp_session, CorrectPath(file).c_str(), O_RDONLY, 0);
+    sftp_file handle = sftp_open(m_sftp_session, CSFTPDirectory::CorrectPath(file).c_str(), O_RDONLY, 0);
     if (handle)
     {
       sftp_file_set_blocking(handle);
@@ -115,166 +186,142 @@ sftp_file CSFTPSession::CreateFileHande(const std::string& file)
   return NULL;
 }
 
-void CSFTPSession::CloseFileHandle(sftp_file handle)
+/*!
+ \brief Closes \e handle, or leaves that to FinishClosing() if it can't be done within \e timeoutMs.
+ */
+void CSFTPSession::CloseFileHandle(sftp_file handle, uint32_t timeoutMs)
 {
-  PLATFORM::CLockObject lock(m_lock);
-  sftp_close(handle);
+  PLATFORM::CTimeout deadline(timeoutMs);
+  CSFTPTraceSpan span("Close");
+  CSFTPScheduledLock lock(m_scheduler, SFTP_REQUEST_METADATA, timeoutMs, &span);
+  if (lock.IsLocked())
+  {
+    // Replies to abandoned reads of the handle are still on their way. On a stalled server the
+    // close doesn't wait for them, FinishClosing() receives them and closes the handle later
+    uint32_t drainMs = SFTP_CLOSE_DRAIN_MS;
+    if (timeoutMs > 0)
+      drainMs = std::min(drainMs, TimeLeft(deadline, timeoutMs));
+    if (ReceiveOutstanding(drainMs))
+    {
+      sftp_close(handle);
+      return;
+    }
+  }
+  else
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPSession: Timed out waiting to close file, leaving it to the maintenance thread");
+
+  PLATFORM::CLockObject closingLock(m_closingLock);
+  m_closing.insert(handle);
 }
 
+/*!
+ \brief Lists the items of \e folder that pass \e filter, from the metadata cache if it is known there.
+
+ Cached listings are returned right away, outdated ones are revalidated by the
+ maintenance thread afterwards. Only complete listings are cached, a filtered
+ one that had to be read from the server is not.
+ */
 bool CSFTPSession::GetDirectory(const std::string& base, const std::string& folder,
-                                std::vector<VFSDirEntry>& items)
+                                std::vector<VFSDirEntry>& items, const CSFTPDirectoryFilter& filter, uint32_t timeoutMs)
 {
-  int sftp_error = SSH_FX_OK;
-  if (m_connected)
+  CSFTPTraceSpan span("GetDirectory");
+  span.SetPath(folder.c_str());
+  if (!m_connected)
   {
-    sftp_dir dir = NULL;
-
-    PLATFORM::CLockObject lock(m_lock);
-    m_LastActive = PLATFORM::GetTimeMs();
-    dir = sftp_opendir(m_sftp_session, CorrectPath(folder).c_str());
-
-    //Doing as little work as possible within the critical section
-    if (!dir)
-      sftp_error = sftp_get_error(m_sftp_session);
-
-    lock.Unlock();
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPSession: Not connected, can't list directory '%s'", folder.c_str());
+    return false;
+  }
 
-    if (!dir)
-    {
-      XBMC->Log(ADDON::LOG_ERROR, "%s: %s for '%s'", __FUNCTION__, SFTPErrorText(sftp_error), folder.c_str());
-    }
-    else
-    {
-      bool read = true;
-      while (read)
-      {
-        sftp_attributes attributes = NULL;
+  m_LastActive = PLATFORM::GetTimeMs();
 
-        lock.Lock();
-        read = sftp_dir_eof(dir) == 0;
-        attributes = sftp_readdir(m_sftp_session, dir);
-        lock.Unlock();
+  std::vector<CSFTPMetadataCache::Item> listing;
+  if (m_cache->GetDirectory(folder, listing))
+  {
+    if (m_cache->HasPending())
+      CSFTPSessionManager::Get().RequestMaintenance();
+  }
+  else if (filter.IsActive())
+  {
+    int64_t mtime = 0;
+    if (!ReadDirectory(folder, listing, mtime, SFTP_REQUEST_METADATA, timeoutMs, &span, &filter))
+      return false;
+  }
+  else
+  {
+    int64_t mtime = 0;
+    if (!ReadDirectory(folder, listing, mtime, SFTP_REQUEST_METADATA, timeoutMs, &span, NULL))
+      return false;
+    m_cache->PutDirectory(folder, mtime, listing);
+  }
 
-        if (attributes && (attributes->name == NULL || strcmp(attributes->name, "..") == 0 || strcmp(attributes->name, ".") == 0))
-        {
-          lock.Lock();
-          sftp_attributes_free(attributes);
-          lock.Unlock();
-          continue;
-        }
-        
-        if (attributes)
-        {
-          std::string itemName = attributes->name;
-          std::string localPath = folder;
-          localPath.append(itemName);
-
-          if (attributes->type == SSH_FILEXFER_TYPE_SYMLINK)
-          {
-            lock.Lock();
-            sftp_attributes_free(attributes);
-            attributes = sftp_stat(m_sftp_session, CorrectPath(localPath).c_str());
-            lock.Unlock();
-            if (attributes == NULL)
-              continue;
-          }
-
-          VFSDirEntry entry;
-          entry.label = strdup(itemName.c_str());
-          entry.title = NULL;
-
-          if (itemName[0] == '.')
-          {
-            entry.properties = new VFSProperty;
-            entry.properties->name = strdup("file:hidden");
-            entry.properties->val = strdup("true");
-            entry.num_props = 1;
-          }
-          else
-          {
-            entry.properties = NULL;
-            entry.num_props = 0;
-          }
-
-/*          if (attributes->flags & SSH_FILEXFER_ATTR_ACMODTIME)
-          {
-            entry.mtime.dwLowDateTime = attributes->mtime64 & ((1LL << 32)-1);
-            entry.mtime.dwHighDateTime = attributes->mtime64 >> 32;
-          }
-*/
-          if (attributes->type & SSH_FILEXFER_TYPE_DIRECTORY)
-          {
-            localPath.append("/");
-            entry.folder = true;
-            entry.size = 0;
-          }
-          else
-          {
-            entry.size = attributes->size;
-            entry.folder = false;
-          }
-
-          entry.path = strdup((base+localPath).c_str());
-          items.push_back(entry);
-
-          lock.Lock();
-          sftp_attributes_free(attributes);
-          lock.Unlock();
-        }
-        else
-          read = false;
-      }
+  items.reserve(items.size() + listing.size());
+  for (std::vector<CSFTPMetadataCache::Item>::const_iterator item = listing.begin(); item != listing.end(); ++item)
+  {
+    if (!filter.Includes(item->name.c_str(), item->folder))
+      continue;
 
-      lock.Lock();
-      sftp_closedir(dir);
-      lock.Unlock();
+    struct sftp_attributes_struct attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.type = item->folder ? SSH_FILEXFER_TYPE_DIRECTORY : SSH_FILEXFER_TYPE_REGULAR;
+    attributes.size = item->size;
 
-      return true;
-    }
+    VFSDirEntry entry;
+    CSFTPDirectory::ToDirEntry(base, folder, item->name, filter.GetOptions(), &attributes, entry);
+    items.push_back(entry);
   }
-  else
-    XBMC->Log(ADDON::LOG_ERROR, "SFTPSession: Not connected, can't list directory '%s'", folder.c_str());
 
-  return false;
+  return true;
 }
 
-bool CSFTPSession::DirectoryExists(const char *path)
+bool CSFTPSession::DirectoryExists(const char *path, uint32_t timeoutMs)
 {
   bool exists = false;
   uint32_t permissions = 0;
-  exists = GetItemPermissions(path, permissions);
+  exists = GetItemPermissions(path, permissions, timeoutMs);
   return exists && S_ISDIR(permissions);
 }
 
-bool CSFTPSession::FileExists(const char *path)
+bool CSFTPSession::FileExists(const char *path, uint32_t timeoutMs)
 {
   bool exists = false;
   uint32_t permissions = 0;
-  exists = GetItemPermissions(path, permissions);
+  exists = GetItemPermissions(path, permissions, timeoutMs);
   return exists && S_ISREG(permissions);
 }
 
-int CSFTPSession::Stat(const char *path, struct __stat64* buffer)
+int CSFTPSession::Stat(const char *path, struct __stat64* buffer, uint32_t timeoutMs)
 {
+  CSFTPTraceSpan span("Stat");
+  span.SetPath(path);
   if(m_connected)
   {
-    PLATFORM::CLockObject lock(m_lock);
     m_LastActive = PLATFORM::GetTimeMs();
-    sftp_attributes attributes = sftp_stat(m_sftp_session, CorrectPath(path).c_str());
 
-    if (attributes)
+    CSFTPMetadataCache::Attributes cached;
+    if (m_cache->GetAttributes(path, cached))
+    {
+      if (m_cache->HasPending())
+        CSFTPSessionManager::Get().RequestMaintenance();
+      AttributesToStat(cached, buffer);
+      return 0;
+    }
+
+    PLATFORM::CTimeout deadline(timeoutMs);
+    CSFTPScheduledLock lock(m_scheduler, SFTP_REQUEST_METADATA, timeoutMs, &span);
+    if (!lock.IsLocked() || !ReceiveOutstanding(TimeLeft(deadline, timeoutMs)))
     {
-      memset(buffer, 0, sizeof(struct __stat64));
-      buffer->st_size = attributes->size;
-      buffer->st_mtime = attributes->mtime;
-      buffer->st_atime = attributes->atime;
+      XBMC->Log(ADDON::LOG_ERROR, "SFTPSession::Stat - Timed out waiting to get attributes for '%s'", path);
+      return -1;
+    }
 
-      if S_ISDIR(attributes->permissions)
-        buffer->st_mode = S_IFDIR;
-      else if S_ISREG(attributes->permissions)
-        buffer->st_mode = S_IFREG;
+    sftp_attributes attributes = sftp_stat(m_sftp_session, CSFTPDirectory::CorrectPath(path).c_str());
 
+    if (attributes)
+    {
+      cached = ToCachedAttributes(attributes);
       sftp_attributes_free(attributes);
+      m_cache->PutAttributes(path, cached);
+      AttributesToStat(cached, buffer);
       return 0;
     }
     else
@@ -290,37 +337,257 @@ int CSFTPSession::Stat(const char *path, struct __stat64* buffer)
   }
 }
 
-int CSFTPSession::Seek(sftp_file handle, uint64_t position)
+int CSFTPSession::FStat(sftp_file handle, struct __stat64* buffer, uint32_t timeoutMs)
 {
-  PLATFORM::CLockObject lock(m_lock);
+  PLATFORM::CTimeout deadline(timeoutMs);
+  CSFTPTraceSpan span("FStat");
+  CSFTPScheduledLock lock(m_scheduler, SFTP_REQUEST_METADATA, timeoutMs, &span);
+  if (!lock.IsLocked() || !ReceiveOutstanding(TimeLeft(deadline, timeoutMs)))
+  {
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPSession::FStat - Timed out waiting to get attributes for open file");
+    return -1;
+  }
+
+  m_LastActive = PLATFORM::GetTimeMs();
+  sftp_attributes attributes = sftp_fstat(handle);
+
+  if (attributes)
+  {
+    AttributesToStat(ToCachedAttributes(attributes), buffer);
+    sftp_attributes_free(attributes);
+    return 0;
+  }
+
+  XBMC->Log(ADDON::LOG_ERROR, "SFTPSession::FStat - Failed to get attributes for open file");
+  return -1;
+}
+
+int CSFTPSession::Seek(sftp_file handle, uint64_t position, uint32_t timeoutMs)
+{
+  CSFTPTraceSpan span("Seek");
+  CSFTPScheduledLock lock(m_scheduler, SFTP_REQUEST_PLAYBACK, timeoutMs, &span);
+  if (!lock.IsLocked())
+    return -1;
+
   m_LastActive = PLATFORM::GetTimeMs();
   int result = sftp_seek64(handle, position);
   return result;
 }
 
-int CSFTPSession::Read(sftp_file handle, void *buffer, size_t length)
+/*!
+ \brief Reads \e length bytes from the current position of the file in one pipelined burst.
+ \param handle Open remote file.
+ \param buffer Buffer receiving the data, must hold at least \e length bytes.
+ \param length Number of bytes to read, usually the size of the whole file.
+ \return Returns the number of bytes read (less than \e length at end of file), or -1 on error.
+
+ All read requests are sent before the first reply is awaited, so the whole
+ transfer costs about one round trip instead of one per chunk.
+ */
+int CSFTPSession::ReadFully(sftp_file handle, void *buffer, size_t length, uint32_t timeoutMs)
 {
-  PLATFORM::CLockObject lock(m_lock);
+  char *data = (char*)buffer;
+  std::vector<int> requests;
+
+  PLATFORM::CTimeout deadline(timeoutMs);
+  CSFTPTraceSpan span("ReadFully");
+  CSFTPScheduledLock lock(m_scheduler, SFTP_REQUEST_METADATA, timeoutMs, &span);
+  if (!lock.IsLocked() || !ReceiveOutstanding(TimeLeft(deadline, timeoutMs)))
+  {
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPSession::ReadFully - Timed out waiting to read %u bytes", (unsigned int)length);
+    return -1;
+  }
+
   m_LastActive = PLATFORM::GetTimeMs();
-  int result=sftp_read(handle, buffer, length);
-  return result;
+
+  uint64_t start = sftp_tell64(handle);
+  for (size_t offset = 0; offset < length; offset += SFTP_READ_CHUNK_SIZE)
+  {
+    uint32_t chunk = (uint32_t)std::min((size_t)SFTP_READ_CHUNK_SIZE, length - offset);
+    int id = sftp_async_read_begin(handle, chunk);
+    if (id < 0)
+      break;
+    requests.push_back(id);
+  }
+
+  // Collect every reply, even after a failed or short one, so none is left queued in libssh
+  size_t received = 0;
+  bool contiguous = true;
+  bool failed = false;
+  for (size_t i = 0; i < requests.size(); i++)
+  {
+    size_t offset = i * SFTP_READ_CHUNK_SIZE;
+    uint32_t chunk = (uint32_t)std::min((size_t)SFTP_READ_CHUNK_SIZE, length - offset);
+    int result = AsyncRead(handle, data + offset, chunk, requests[i]);
+    if (result < 0)
+      failed = true;
+    else if (contiguous)
+    {
+      received += result;
+      contiguous = (uint32_t)result == chunk;
+    }
+  }
+
+  if (failed)
+  {
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPSession::ReadFully - Failed to read %u bytes", (unsigned int)length);
+    return -1;
+  }
+
+  // The server may answer with less than requested before end of file, fetch the rest serially
+  if (received < length && sftp_seek64(handle, start + received) == 0)
+  {
+    int result;
+    while (received < length && (result = sftp_read(handle, data + received, length - received)) > 0)
+      received += result;
+  }
+
+  span.SetBytes(received);
+  return received;
 }
 
-int64_t CSFTPSession::GetPosition(sftp_file handle)
+/*!
+ \brief Sends a read request for \e length bytes at \e position without waiting for the reply.
+ \return Returns the request id to pass to EndRead(), or -1 on error or if the session
+         wasn't available within \e timeoutMs.
+ */
+int CSFTPSession::BeginRead(sftp_file handle, uint64_t position, uint32_t length, SFTPRequestClass requestClass, uint32_t timeoutMs)
 {
-  PLATFORM::CLockObject lock(m_lock);
+  CSFTPTraceSpan span("BeginRead");
+  span.SetBytes(length);
+  CSFTPScheduledLock lock(m_scheduler, requestClass, timeoutMs, &span);
+  if (!lock.IsLocked())
+    return -1;
+
   m_LastActive = PLATFORM::GetTimeMs();
-  int64_t result = sftp_tell64(handle);
-  return result;
+  ReceiveReplies(-1, NULL, 0, false, 0);
+  if (sftp_seek64(handle, position) < 0)
+    return -1;
+
+  int id = sftp_async_read_begin(handle, length);
+  span.SetRequestId(id);
+  if (id < 0)
+    return -1;
+
+  PendingRead read;
+  read.handle = handle;
+  read.id = id;
+  read.length = length;
+  read.abandoned = false;
+  PLATFORM::CLockObject readsLock(m_readsLock);
+  m_pending.push_back(read);
+  return id;
+}
+
+/*!
+ \brief Waits for the reply to a request sent with BeginRead().
+ \param timeoutMs Longest time to wait in ms, 0 waits without limit. When it passes the request
+        is abandoned and the handle stays usable.
+ \return Returns the number of bytes read, 0 at end of file or -1 on error or timeout.
+ */
+int CSFTPSession::EndRead(sftp_file handle, int id, void *buffer, uint32_t length, SFTPRequestClass requestClass, uint32_t timeoutMs)
+{
+  PLATFORM::CTimeout deadline(timeoutMs);
+  CSFTPTraceSpan span("EndRead");
+  span.SetRequestId(id);
+  CSFTPScheduledLock lock(m_scheduler, requestClass, timeoutMs, &span);
+  if (!lock.IsLocked())
+  {
+    AbandonRead(id);
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPSession::EndRead - Timed out waiting for the session");
+    return -1;
+  }
+
+  m_LastActive = PLATFORM::GetTimeMs();
+  int result = ReceiveReplies(id, buffer, length, true, TimeLeft(deadline, timeoutMs));
+  if (result == SSH_AGAIN)
+  {
+    AbandonRead(id);
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPSession::EndRead - Timed out waiting for the server");
+    return -1;
+  }
+
+  span.SetBytes(result);
+  return result < 0 ? -1 : result;
+}
+
+/*!
+ \brief Marks a request sent with BeginRead() as no longer needed, without waiting for the session.
+
+ Nobody waits for the reply, it is dropped once it has been taken off the channel
+ in turn with the replies to the other requests.
+ */
+void CSFTPSession::AbandonRead(int id)
+{
+  CSFTPTraceSpan span("AbandonRead");
+  span.SetRequestId(id);
+  PLATFORM::CLockObject lock(m_readsLock);
+  std::map<int, ReceivedRead>::iterator received = m_received.find(id);
+  if (received != m_received.end())
+  {
+    CSFTPBufferPool::Get().ReleaseSlab(received->second.data);
+    m_received.erase(received);
+    return;
+  }
+
+  for (std::deque<PendingRead>::iterator pending = m_pending.begin(); pending != m_pending.end(); ++pending)
+  {
+    if (pending->id == id)
+    {
+      pending->abandoned = true;
+      break;
+    }
+  }
 }
 
 bool CSFTPSession::IsIdle()
 {
-  return (PLATFORM::GetTimeMs() - m_LastActive) > 90000;
+  return (PLATFORM::GetTimeMs() - m_LastActive) > SFTP_IDLE_TIMEOUT_MS;
+}
+
+bool CSFTPSession::NeedsKeepAlive()
+{
+  int64_t now = PLATFORM::GetTimeMs();
+  return m_connected &&
+         now - m_LastActive > SFTP_KEEPALIVE_INTERVAL_MS &&
+         now - m_LastKeepAlive > SFTP_KEEPALIVE_INTERVAL_MS;
+}
+
+/*!
+ \brief Sends an SSH ignore message, which does not count as activity for IsIdle().
+ */
+void CSFTPSession::SendKeepAlive()
+{
+  CSFTPTraceSpan span("KeepAlive");
+  CSFTPScheduledLock lock(m_scheduler, SFTP_REQUEST_BULK, 0, &span);
+  m_LastKeepAlive = PLATFORM::GetTimeMs();
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0,6,0)
+  if (m_connected && m_session)
+    ssh_send_ignore(m_session, "keepalive");
+#endif
 }
 
-bool CSFTPSession::VerifyKnownHost(ssh_session session)
+bool CSFTPSession::VerifyKnownHost(ssh_session session, VFSURL* url)
 {
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0,6,0)
+  // Known keys are confirmed from memory, libssh re-reads and re-parses the file on every check
+  bool known = false;
+  ssh_key key = NULL;
+  if (ssh_get_publickey(session, &key) == SSH_OK)
+  {
+    char *base64 = NULL;
+    if (ssh_pki_export_pubkey_base64(key, &base64) == SSH_OK)
+    {
+      known = CSFTPKnownHosts::Get().IsKnown(url->hostname, url->port, ssh_key_type_to_char(ssh_key_type(key)), base64);
+      ssh_string_free_char(base64);
+    }
+    ssh_key_free(key);
+  }
+
+  if (known)
+    return true;
+#endif
+
   switch (ssh_is_server_known(session))
   {
     case SSH_SERVER_KNOWN_OK:
@@ -341,6 +608,7 @@ bool CSFTPSession::VerifyKnownHost(ssh_session session)
         return false;
       }
 
+      CSFTPKnownHosts::Get().Invalidate();
       return true;
     case SSH_SERVER_ERROR:
       XBMC->Log(ADDON::LOG_ERROR, "SFTPSession: Failed to verify host '%s'", ssh_get_error(session));
@@ -352,6 +620,8 @@ bool CSFTPSession::VerifyKnownHost(ssh_session session)
 
 bool CSFTPSession::Connect(VFSURL* url)
 {
+  CSFTPTraceSpan span("Connect");
+  span.SetPath(url->hostname);
   int timeout     = SFTP_TIMEOUT;
   m_connected     = false;
   m_session       = NULL;
@@ -413,13 +683,20 @@ bool CSFTPSession::Connect(VFSURL* url)
   ssh_set_options(m_session, options);
 #endif
 
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0,4,0)
+  // libssh tries the resolved addresses one at a time, each with the full timeout
+  socket_t fd = CSFTPConnector::Get().Connect(url->hostname, url->port, SFTP_TIMEOUT * 1000);
+  if (fd != SSH_INVALID_SOCKET)
+    ssh_options_set(m_session, SSH_OPTIONS_FD, &fd);
+#endif
+
   if(ssh_connect(m_session))
   {
     XBMC->Log(ADDON::LOG_ERROR, "SFTPSession: Failed to connect '%s'", ssh_get_error(m_session));
     return false;
   }
 
-  if (!VerifyKnownHost(m_session))
+  if (!VerifyKnownHost(m_session, url))
   {
     XBMC->Log(ADDON::LOG_ERROR, "SFTPSession: Host is not known '%s'", ssh_get_error(m_session));
     return false;
@@ -486,6 +763,7 @@ bool CSFTPSession::Connect(VFSURL* url)
 
 void CSFTPSession::Disconnect()
 {
+  CSFTPTraceSpan span("Disconnect");
   if (m_sftp_session)
     sftp_free(m_sftp_session);
 
@@ -500,15 +778,36 @@ void CSFTPSession::Disconnect()
  \brief Gets POSIX compatible permissions information about the specified file or directory.
  \param path Remote SSH path to the file or directory.
  \param permissions POSIX compatible permissions information for the file or directory (if it exists). i.e. can use macros S_ISDIR() etc.
+ \param timeoutMs Longest time to wait for the session in ms, 0 waits without limit.
  \return Returns \e true, if it was possible to get permissions for the file or directory, \e false otherwise.
  */
-bool CSFTPSession::GetItemPermissions(const char *path, uint32_t &permissions)
+bool CSFTPSession::GetItemPermissions(const char *path, uint32_t &permissions, uint32_t timeoutMs)
 {
   bool gotPermissions = false;
-  PLATFORM::CLockObject lock(m_lock);
-  if(m_connected)
+  CSFTPTraceSpan span("GetItemPermissions");
+  span.SetPath(path);
+
+  CSFTPMetadataCache::Attributes cached;
+  if (m_connected && m_cache->GetAttributes(path, cached))
   {
-    sftp_attributes attributes = sftp_stat(m_sftp_session, CorrectPath(path).c_str());
+    m_LastActive = PLATFORM::GetTimeMs();
+    if (m_cache->HasPending())
+      CSFTPSessionManager::Get().RequestMaintenance();
+    if (cached.flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+    {
+      permissions = cached.permissions;
+      gotPermissions = true;
+    }
+    return gotPermissions;
+  }
+
+  PLATFORM::CTimeout deadline(timeoutMs);
+  CSFTPScheduledLock lock(m_scheduler, SFTP_REQUEST_METADATA, timeoutMs, &span);
+  if (!lock.IsLocked() || !ReceiveOutstanding(TimeLeft(deadline, timeoutMs)))
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPSession: Timed out waiting to get permissions for '%s'", path);
+  else if(m_connected)
+  {
+    sftp_attributes attributes = sftp_stat(m_sftp_session, CSFTPDirectory::CorrectPath(path).c_str());
     if (attributes)
     {
       if (attributes->flags & SSH_FILEXFER_ATTR_PERMISSIONS)
@@ -517,12 +816,340 @@ bool CSFTPSession::GetItemPermissions(const char *path, uint32_t &permissions)
         gotPermissions = true;
       }
 
+      m_cache->PutAttributes(path, ToCachedAttributes(attributes));
       sftp_attributes_free(attributes);
     }
   }
   return gotPermissions;
 }
 
+/*!
+ \brief Lists \e folder on the server, resolving symlinks to the type and size of their target.
+ \param mtime Set to the modification time of \e folder, taken from its "." entry, 0 if the server didn't send one.
+ \param filter If set, items it leaves out are skipped as early as possible, symlinks excluded by name aren't resolved.
+ */
+bool CSFTPSession::ReadDirectory(const std::string& folder, std::vector<CSFTPMetadataCache::Item>& items, int64_t& mtime,
+                                 SFTPRequestClass requestClass, uint32_t timeoutMs, CSFTPTraceSpan* span,
+                                 const CSFTPDirectoryFilter* filter)
+{
+  int sftp_error = SSH_FX_OK;
+  sftp_dir dir = NULL;
+
+  PLATFORM::CTimeout deadline(timeoutMs);
+  CSFTPScheduledLock lock(m_scheduler, requestClass, timeoutMs, span);
+  if (!lock.IsLocked() || !ReceiveOutstanding(TimeLeft(deadline, timeoutMs)))
+  {
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPSession: Timed out waiting to list directory '%s'", folder.c_str());
+    return false;
+  }
+
+  dir = sftp_opendir(m_sftp_session, CSFTPDirectory::CorrectPath(folder).c_str());
+
+  //Doing as little work as possible within the critical section
+  if (!dir)
+    sftp_error = sftp_get_error(m_sftp_session);
+
+  lock.Unlock();
+
+  if (!dir)
+  {
+    XBMC->Log(ADDON::LOG_ERROR, "%s: %s for '%s'", __FUNCTION__, SFTPErrorText(sftp_error), folder.c_str());
+    return false;
+  }
+
+  // Freeing attributes only releases memory, the session is only held for requests
+  bool read = true;
+  bool timedOut = false;
+  while (read)
+  {
+    sftp_attributes attributes = NULL;
+
+    if (!lock.Lock(TimeLeft(deadline, timeoutMs)) || !ReceiveOutstanding(TimeLeft(deadline, timeoutMs)))
+    {
+      timedOut = true;
+      break;
+    }
+    read = sftp_dir_eof(dir) == 0;
+    attributes = sftp_readdir(m_sftp_session, dir);
+    lock.Unlock();
+
+    if (attributes && (attributes->name == NULL || strcmp(attributes->name, "..") == 0 || strcmp(attributes->name, ".") == 0))
+    {
+      if (attributes->name && strcmp(attributes->name, ".") == 0 && (attributes->flags & SSH_FILEXFER_ATTR_ACMODTIME))
+        mtime = attributes->mtime;
+
+      sftp_attributes_free(attributes);
+      continue;
+    }
+
+    if (attributes && filter && (filter->ExcludesName(attributes->name) ||
+        (attributes->type != SSH_FILEXFER_TYPE_SYMLINK &&
+         !filter->Includes(attributes->name, (attributes->type & SSH_FILEXFER_TYPE_DIRECTORY) != 0))))
+    {
+      sftp_attributes_free(attributes);
+      continue;
+    }
+
+    if (attributes)
+    {
+      CSFTPMetadataCache::Item item;
+      item.name = attributes->name;
+
+      if (attributes->type == SSH_FILEXFER_TYPE_SYMLINK)
+      {
+        std::string localPath = folder;
+        localPath.append(item.name);
+
+        CSFTPTraceSpan symlinkSpan("GetDirectory.SymlinkStat");
+        symlinkSpan.SetPath(localPath.c_str());
+        sftp_attributes_free(attributes);
+        if (!lock.Lock(TimeLeft(deadline, timeoutMs)) || !ReceiveOutstanding(TimeLeft(deadline, timeoutMs)))
+        {
+          timedOut = true;
+          break;
+        }
+        attributes = sftp_stat(m_sftp_session, CSFTPDirectory::CorrectPath(localPath).c_str());
+        lock.Unlock();
+        if (attributes == NULL)
+          continue;
+      }
+
+      item.folder = (attributes->type & SSH_FILEXFER_TYPE_DIRECTORY) != 0;
+      item.size = attributes->size;
+      item.mtime = attributes->mtime;
+
+      // The type of a symlink is only known once it has been resolved
+      if (!filter || filter->Includes(item.name.c_str(), item.folder))
+        items.push_back(item);
+
+      sftp_attributes_free(attributes);
+    }
+    else
+      read = false;
+  }
+
+  if (lock.Lock(TimeLeft(deadline, timeoutMs)) && ReceiveOutstanding(TimeLeft(deadline, timeoutMs)))
+  {
+    sftp_closedir(dir);
+    lock.Unlock();
+  }
+  else
+  {
+    lock.Unlock();
+    PLATFORM::CLockObject closingLock(m_closingLock);
+    m_closingDirs.push_back(dir);
+  }
+
+  if (timedOut)
+  {
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPSession: Timed out listing directory '%s'", folder.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+/*!
+ \brief Checks everything the metadata cache served without recent confirmation against the server.
+
+ Runs on the maintenance thread as bulk work. A listing is only fetched again if
+ the mtime of its directory changed, and doesn't count as activity for IsIdle().
+ */
+void CSFTPSession::Revalidate()
+{
+  if (!m_connected)
+    return;
+
+  CSFTPTraceSpan span("Revalidate");
+  std::vector<std::string> folders, paths;
+  m_cache->TakePending(folders, paths);
+
+  for (size_t i = 0; i < folders.size(); i++)
+  {
+    int sftp_error = SSH_FX_OK;
+    int64_t mtime = 0;
+    {
+      CSFTPScheduledLock lock(m_scheduler, SFTP_REQUEST_BULK, 0, &span);
+      ReceiveOutstanding(0);
+      sftp_attributes attributes = sftp_stat(m_sftp_session, CSFTPDirectory::CorrectPath(folders[i]).c_str());
+      if (attributes)
+      {
+        mtime = attributes->mtime;
+        sftp_attributes_free(attributes);
+      }
+      else
+        sftp_error = sftp_get_error(m_sftp_session);
+    }
+
+    if (sftp_error == SSH_FX_NO_SUCH_FILE)
+      m_cache->Remove(folders[i]);
+    else if (sftp_error == SSH_FX_OK && !m_cache->ConfirmDirectory(folders[i], mtime))
+    {
+      std::vector<CSFTPMetadataCache::Item> listing;
+      if (ReadDirectory(folders[i], listing, mtime, SFTP_REQUEST_BULK, 0, &span, NULL))
+        m_cache->PutDirectory(folders[i], mtime, listing);
+    }
+  }
+
+  for (size_t i = 0; i < paths.size(); i++)
+  {
+    CSFTPScheduledLock lock(m_scheduler, SFTP_REQUEST_BULK, 0, &span);
+    ReceiveOutstanding(0);
+    sftp_attributes attributes = sftp_stat(m_sftp_session, CSFTPDirectory::CorrectPath(paths[i]).c_str());
+    if (attributes)
+    {
+      m_cache->PutAttributes(paths[i], ToCachedAttributes(attributes));
+      sftp_attributes_free(attributes);
+    }
+    else if (sftp_get_error(m_sftp_session) == SSH_FX_NO_SUCH_FILE)
+      m_cache->Remove(paths[i]);
+  }
+}
+
+bool CSFTPSession::NeedsRevalidation()
+{
+  return m_connected && m_cache->HasPending();
+}
+
+bool CSFTPSession::NeedsFinishClosing()
+{
+  PLATFORM::CLockObject lock(m_closingLock);
+  return !m_closing.empty() || !m_closingDirs.empty();
+}
+
+/*!
+ \brief Closes the handles and listings CloseFileHandle() and ReadDirectory() couldn't close in time.
+
+ Runs on the maintenance thread as bulk work. Closing waits for the replies to all
+ outstanding reads first, if they don't arrive in time the next pass tries again.
+ */
+void CSFTPSession::FinishClosing()
+{
+  CSFTPTraceSpan span("FinishClosing");
+  CSFTPScheduledLock lock(m_scheduler, SFTP_REQUEST_BULK, 0, &span);
+  if (!ReceiveOutstanding(SFTP_CLOSE_DRAIN_MS))
+    return;
+
+  PLATFORM::CLockObject closingLock(m_closingLock);
+  for (std::set<sftp_file>::iterator it = m_closing.begin(); it != m_closing.end(); ++it)
+    sftp_close(*it);
+  m_closing.clear();
+
+  for (size_t i = 0; i < m_closingDirs.size(); i++)
+    sftp_closedir(m_closingDirs[i]);
+  m_closingDirs.clear();
+}
+
+/*!
+ \brief Takes replies off the channel in the order their requests were sent until the one to \e id is in,
+        must be called with the session scheduled.
+
+ libssh only looks for a reply it already queued after receiving another packet, so
+ a reply taken off out of order can be stuck until the next one arrives or libssh
+ times out. Replies to earlier requests are kept until EndRead() asks for them, those
+ to abandoned requests are dropped.
+ \param id Request whose reply is wanted, -1 to receive the replies to all outstanding requests.
+ \param buffer Receives the reply to \e id, at most \e length bytes.
+ \param wait If \e false, only replies that already arrived are taken.
+ \param timeoutMs Longest time to wait if \e wait is set in ms, 0 waits without limit.
+ \return Returns the result of the reply to \e id (0 once all are in if \e id is -1), SSH_AGAIN if it
+         didn't arrive in time or SSH_ERROR.
+ */
+int CSFTPSession::ReceiveReplies(int id, void *buffer, uint32_t length, bool wait, uint32_t timeoutMs)
+{
+  PLATFORM::CTimeout deadline(timeoutMs);
+  for (;;)
+  {
+    PendingRead next;
+    {
+      PLATFORM::CLockObject lock(m_readsLock);
+      std::map<int, ReceivedRead>::iterator received = id >= 0 ? m_received.find(id) : m_received.end();
+      if (received != m_received.end())
+      {
+        int result = received->second.result;
+        if (result > 0)
+        {
+          result = std::min(result, (int)length);
+          memcpy(buffer, received->second.data, result);
+        }
+        CSFTPBufferPool::Get().ReleaseSlab(received->second.data);
+        m_received.erase(received);
+        return result;
+      }
+
+      if (m_pending.empty())
+        return id < 0 ? 0 : SSH_ERROR;
+      next = m_pending.front();
+    }
+
+    // The wanted reply goes straight to the caller, any other into a slab until it is asked for
+    char *data = (char*)buffer;
+    uint32_t size = length;
+    if (next.id != id)
+    {
+      data = CSFTPBufferPool::Get().AcquireSlab(true);
+      size = std::min(next.length, (uint32_t)SFTP_READ_CHUNK_SIZE);
+    }
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0,6,0)
+    bool block = wait && timeoutMs == 0;
+#else
+    // Older libssh can't wait on the channel with a timeout
+    bool block = wait;
+#endif
+    int result;
+    if (block)
+      result = AsyncRead(next.handle, data, size, next.id);
+    else
+    {
+      sftp_file_set_nonblocking(next.handle);
+      while ((result = AsyncRead(next.handle, data, size, next.id)) == SSH_AGAIN && wait && deadline.TimeLeft() > 0)
+      {
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0,6,0)
+        ssh_channel_poll_timeout(m_sftp_session->channel, std::min(deadline.TimeLeft(), (uint32_t)SFTP_READ_POLL_MS), 0);
+#endif
+      }
+      sftp_file_set_blocking(next.handle);
+    }
+
+    if (result == SSH_AGAIN)
+    {
+      if (next.id != id)
+        CSFTPBufferPool::Get().ReleaseSlab(data);
+      return SSH_AGAIN;
+    }
+
+    PLATFORM::CLockObject lock(m_readsLock);
+    bool abandoned = m_pending.front().abandoned;
+    m_pending.pop_front();
+    if (next.id == id)
+      return result;
+
+    if (abandoned)
+      CSFTPBufferPool::Get().ReleaseSlab(data);
+    else
+    {
+      ReceivedRead read;
+      read.data = data;
+      read.result = result;
+      m_received[next.id] = read;
+    }
+  }
+}
+
+/*!
+ \brief Receives the replies to all outstanding reads, must be called with the session scheduled.
+
+ A synchronous request reads every packet up to its own reply, replies to reads
+ still outstanding would get stuck in the libssh queue.
+ \param timeoutMs Longest time to wait in ms, 0 waits without limit.
+ \return Returns \e false if they didn't all arrive in time or the connection failed.
+ */
+bool CSFTPSession::ReceiveOutstanding(uint32_t timeoutMs)
+{
+  return ReceiveReplies(-1, NULL, 0, true, timeoutMs) == 0;
+}
+
 CSFTPSessionManager& CSFTPSessionManager::Get()
 {
   static CSFTPSessionManager instance;
@@ -530,40 +1157,238 @@ CSFTPSessionManager& CSFTPSessionManager::Get()
   return instance;
 }
 
+/*!
+ \brief Returns the session for the host, user and password of \e url, connecting a new one if needed.
+
+ Looking up an existing session takes only the lock of one shard and allocates
+ nothing. New sessions connect without any lock held. A placeholder entry marks
+ the connect in progress, later callers for the same identity wait for it instead
+ of opening handshakes of their own, which could trip MaxStartups or fail2ban.
+ */
 CSFTPSessionPtr CSFTPSessionManager::CreateSession(VFSURL* url)
 {
-  // Convert port number to string
-  std::stringstream itoa;
-  itoa << url->port;
-  std::string portstr = itoa.str();
+  uint32_t hash = HashIdentity(url);
+  SessionShard& shard = m_shards[hash % SESSION_SHARDS];
 
-  PLATFORM::CLockObject lock(m_lock);
-  std::string key = std::string(url->username) + ":" + 
-                    url->password + "@" + url->hostname + ":" + portstr;
-  CSFTPSessionPtr ptr = sessions[key];
-  if (ptr == NULL)
+  PLATFORM::CLockObject lock(shard.lock);
+  SessionEntry* found;
+  while ((found = FindEntry(shard, hash, url)) != NULL)
+  {
+    if (found->session)
+      return found->session;
+    shard.connected.Wait(shard.lock);
+  }
+
+  SessionEntry entry;
+  entry.hash = hash;
+  entry.username = url->username;
+  entry.password = url->password;
+  entry.hostname = url->hostname;
+  entry.port = url->port;
+  shard.entries.push_back(entry);
+  lock.Unlock();
+
+  CSFTPTraceSpan span("CreateSession");
+  span.SetPath(url->hostname);
+  CSFTPSessionPtr created(new CSFTPSession(url));
+
+  // The placeholder is gone if all sessions were disconnected meanwhile
+  lock.Lock();
+  found = FindEntry(shard, hash, url);
+  if (found && !found->session)
+    found->session = created;
+  else if (!found)
   {
-    ptr = CSFTPSessionPtr(new CSFTPSession(url));
-    sessions[key] = ptr;
+    entry.session = created;
+    shard.entries.push_back(entry);
   }
+  shard.connected.Broadcast();
+  lock.Unlock();
+
+  PLATFORM::CLockObject managerLock(m_lock);
+  if (!IsRunning())
+    CreateThread(false);
 
-  return ptr;
+  return created;
 }
 
-void CSFTPSessionManager::ClearOutIdleSessions()
+/*!
+ \brief FNV-1a hash of the user, host and port of \e url, the password is left out on purpose.
+ */
+uint32_t CSFTPSessionManager::HashIdentity(const VFSURL* url)
 {
-  PLATFORM::CLockObject lock(m_lock);
-  for(std::map<std::string, CSFTPSessionPtr>::iterator iter = sessions.begin(); iter != sessions.end();)
+  uint32_t hash = 2166136261u;
+  for (const char* c = url->username; *c; c++)
+    hash = (hash ^ (unsigned char)*c) * 16777619u;
+  hash = (hash ^ '@') * 16777619u;
+  for (const char* c = url->hostname; *c; c++)
+    hash = (hash ^ (unsigned char)*c) * 16777619u;
+  for (unsigned int port = url->port, i = 0; i < sizeof(port); i++, port >>= 8)
+    hash = (hash ^ (port & 0xff)) * 16777619u;
+
+  return hash;
+}
+
+/*!
+ \brief Looks up the entry matching \e url in \e shard, must be called with the shard locked.
+ */
+CSFTPSessionManager::SessionEntry* CSFTPSessionManager::FindEntry(SessionShard& shard, uint32_t hash, const VFSURL* url)
+{
+  for (std::vector<SessionEntry>::iterator entry = shard.entries.begin(); entry != shard.entries.end(); ++entry)
   {
-    if (iter->second->IsIdle())
-      sessions.erase(iter++);
-    else
-      iter++;
+    if (entry->hash == hash &&
+        entry->port == url->port &&
+        entry->hostname == url->hostname &&
+        entry->username == url->username &&
+        entry->password == url->password)
+      return &(*entry);
   }
+
+  return NULL;
+}
+
+/*!
+ \brief Asks the maintenance thread to look for idle sessions now instead of at its next round.
+ */
+void CSFTPSessionManager::ClearOutIdleSessions()
+{
+  m_wakeup.Signal();
 }
 
+/*!
+ \brief Wakes the maintenance thread, used when cached metadata waits for revalidation.
+ */
+void CSFTPSessionManager::RequestMaintenance()
+{
+  m_wakeup.Signal();
+}
+
+/*!
+ \brief Forgets all sessions, they are disconnected on the maintenance thread once no file uses them.
+ */
 void CSFTPSessionManager::DisconnectAllSessions()
 {
+  CSFTPTrace::Get().Instant("DisconnectAllSessions", NULL);
+  std::vector<CSFTPSessionPtr> retired;
+  for (unsigned int i = 0; i < SESSION_SHARDS; i++)
+  {
+    PLATFORM::CLockObject lock(m_shards[i].lock);
+    for (std::vector<SessionEntry>::iterator entry = m_shards[i].entries.begin(); entry != m_shards[i].entries.end(); ++entry)
+    {
+      if (entry->session)
+        retired.push_back(entry->session);
+    }
+    m_shards[i].entries.clear();
+  }
+
   PLATFORM::CLockObject lock(m_lock);
-  sessions.clear();
+  m_retired.insert(m_retired.end(), retired.begin(), retired.end());
+  m_wakeup.Signal();
+}
+
+/*!
+ \brief Stops the maintenance thread and disconnects every session on the calling thread, used on unload.
+ */
+void CSFTPSessionManager::Shutdown()
+{
+  CSFTPTraceSpan span("Shutdown");
+  StopThread(-1);
+  m_wakeup.Signal();
+  StopThread();
+
+  CSFTPMetadataCache::SaveAll(true);
+
+  DisconnectAllSessions();
+
+  std::vector<CSFTPSessionPtr> retired;
+  {
+    PLATFORM::CLockObject lock(m_lock);
+    retired.swap(m_retired);
+  }
+}
+
+void* CSFTPSessionManager::Process(void)
+{
+  while (!IsStopped())
+  {
+    m_wakeup.Wait(SFTP_MAINTENANCE_INTERVAL_MS);
+    if (!IsStopped())
+      DoMaintenance();
+  }
+
+  return NULL;
+}
+
+/*!
+ \brief Takes idle and retired sessions out of the manager and disconnects them without holding any lock.
+
+ Teardown and keepalives do network I/O, so CreateSession() never waits on them.
+ */
+void CSFTPSessionManager::DoMaintenance()
+{
+  std::vector<CSFTPSessionPtr> retired;
+  std::vector<CSFTPSessionPtr> keepAlive;
+  std::vector<CSFTPSessionPtr> revalidate;
+  std::vector<CSFTPSessionPtr> closing;
+
+  for (unsigned int i = 0; i < SESSION_SHARDS; i++)
+  {
+    PLATFORM::CLockObject lock(m_shards[i].lock);
+    std::vector<SessionEntry>& entries = m_shards[i].entries;
+    for (size_t j = 0; j < entries.size();)
+    {
+      if (!entries[j].session)
+        j++;
+      else if (entries[j].session->IsIdle())
+      {
+        CSFTPTrace::Get().Instant("SessionIdle", entries[j].hostname.c_str());
+        retired.push_back(entries[j].session);
+        entries[j] = entries.back();
+        entries.pop_back();
+      }
+      else
+      {
+        if (entries[j].session->NeedsKeepAlive())
+          keepAlive.push_back(entries[j].session);
+        if (entries[j].session->NeedsRevalidation())
+          revalidate.push_back(entries[j].session);
+        if (entries[j].session->NeedsFinishClosing())
+          closing.push_back(entries[j].session);
+        j++;
+      }
+    }
+  }
+
+  {
+    PLATFORM::CLockObject lock(m_lock);
+    retired.insert(retired.end(), m_retired.begin(), m_retired.end());
+    m_retired.clear();
+  }
+
+  for (size_t i = 0; i < keepAlive.size(); i++)
+    keepAlive[i]->SendKeepAlive();
+
+  for (size_t i = 0; i < revalidate.size(); i++)
+    revalidate[i]->Revalidate();
+  CSFTPMetadataCache::SaveAll(false);
+
+  for (size_t i = 0; i < closing.size(); i++)
+    closing[i]->FinishClosing();
+
+  // Sessions still used by open files or callers stay retired until the last of them lets
+  // go, so their teardown never runs on a Kodi thread
+  CSFTPTraceSpan span("RetireSessions");
+  std::vector<CSFTPSessionPtr> inUse;
+  for (size_t i = 0; i < retired.size(); i++)
+  {
+    if (!retired[i].unique())
+      inUse.push_back(retired[i]);
+  }
+  retired.clear();
+
+  if (!inUse.empty())
+  {
+    PLATFORM::CLockObject lock(m_lock);
+    m_retired.insert(m_retired.end(), inUse.begin(), inUse.end());
+  }
 }
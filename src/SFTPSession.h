@@ -18,57 +18,144 @@
  *
  */
 
+#pragma once
+
 #include "platform/threads/mutex.h"
+#include "platform/threads/threads.h"
+#include "SFTPDirectory.h"
+#include "SFTPMetadataCache.h"
+#include "SFTPScheduler.h"
 #include <libssh/libssh.h>
 #include <libssh/sftp.h>
 #include <boost/shared_ptr.hpp>
 #include "xbmc_addon_dll.h"
 #include "kodi_vfs_types.h"
+#include <deque>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
+// Size of a single SFTP read request, small enough for every common server
+#define SFTP_READ_CHUNK_SIZE 32768
+
 class CSFTPSession
 {
 public:
   CSFTPSession(VFSURL* url);
   virtual ~CSFTPSession();
 
-  sftp_file CreateFileHande(const std::string& file);
-  void CloseFileHandle(sftp_file handle);
-  bool GetDirectory(const std::string& base, const std::string& folder, std::vector<VFSDirEntry>& items);
-  bool DirectoryExists(const char *path);
-  bool FileExists(const char *path);
-  int Stat(const char *path, struct __stat64* buffer);
-  int Seek(sftp_file handle, uint64_t position);
-  int Read(sftp_file handle, void *buffer, size_t length);
-  int64_t GetPosition(sftp_file handle);
+  // timeoutMs bounds how long a call may wait for the session, 0 waits without limit
+  sftp_file CreateFileHande(const std::string& file, uint32_t timeoutMs = 0);
+  void CloseFileHandle(sftp_file handle, uint32_t timeoutMs = 0);
+  bool GetDirectory(const std::string& base, const std::string& folder, std::vector<VFSDirEntry>& items,
+                    const CSFTPDirectoryFilter& filter = CSFTPDirectoryFilter(), uint32_t timeoutMs = 0);
+  bool DirectoryExists(const char *path, uint32_t timeoutMs = 0);
+  bool FileExists(const char *path, uint32_t timeoutMs = 0);
+  int Stat(const char *path, struct __stat64* buffer, uint32_t timeoutMs = 0);
+  int FStat(sftp_file handle, struct __stat64* buffer, uint32_t timeoutMs = 0);
+  int Seek(sftp_file handle, uint64_t position, uint32_t timeoutMs = 0);
+  int ReadFully(sftp_file handle, void *buffer, size_t length, uint32_t timeoutMs = 0);
+  int BeginRead(sftp_file handle, uint64_t position, uint32_t length, SFTPRequestClass requestClass, uint32_t timeoutMs = 0);
+  int EndRead(sftp_file handle, int id, void *buffer, uint32_t length, SFTPRequestClass requestClass, uint32_t timeoutMs = 0);
+  void AbandonRead(int id);
   bool IsIdle();
+  bool NeedsKeepAlive();
+  void SendKeepAlive();
+  bool NeedsRevalidation();
+  void Revalidate();
+  bool NeedsFinishClosing();
+  void FinishClosing();
 private:
-  bool VerifyKnownHost(ssh_session session);
+  bool VerifyKnownHost(ssh_session session, VFSURL* url);
   bool Connect(VFSURL* url);
   void Disconnect();
-  bool GetItemPermissions(const char *path, uint32_t &permissions);
-  PLATFORM::CMutex m_lock;
+  bool GetItemPermissions(const char *path, uint32_t &permissions, uint32_t timeoutMs);
+  bool ReadDirectory(const std::string& folder, std::vector<CSFTPMetadataCache::Item>& items, int64_t& mtime,
+                     SFTPRequestClass requestClass, uint32_t timeoutMs, CSFTPTraceSpan* span,
+                     const CSFTPDirectoryFilter* filter);
+  int ReceiveReplies(int id, void *buffer, uint32_t length, bool wait, uint32_t timeoutMs);
+  bool ReceiveOutstanding(uint32_t timeoutMs);
+
+  // A request sent with BeginRead() whose reply hasn't been taken off the channel yet
+  struct PendingRead
+  {
+    sftp_file handle;
+    int id;
+    uint32_t length;
+    bool abandoned;
+  };
+
+  // A reply taken off the channel before EndRead() asked for it, kept in a pooled slab
+  struct ReceivedRead
+  {
+    char *data;
+    int result;
+  };
+
+  CSFTPScheduler m_scheduler;
+  // Pending reads in the order they were sent. Guarded by their own lock so abandoning a
+  // request never waits for the session
+  std::deque<PendingRead> m_pending;
+  std::map<int, ReceivedRead> m_received;
+  PLATFORM::CMutex m_readsLock;
+  // Handles and listings whose close was left to the maintenance thread
+  std::set<sftp_file> m_closing;
+  std::vector<sftp_dir> m_closingDirs;
+  PLATFORM::CMutex m_closingLock;
 
   bool m_connected;
   ssh_session  m_session;
   sftp_session m_sftp_session;
-  int m_LastActive;
+  int64_t m_LastActive;
+  int64_t m_LastKeepAlive;
+  CSFTPMetadataCachePtr m_cache;
 };
 
 typedef boost::shared_ptr<CSFTPSession> CSFTPSessionPtr;
 
-class CSFTPSessionManager
+class CSFTPSessionManager : public PLATFORM::CThread
 {
 public:
   static CSFTPSessionManager& Get();
   CSFTPSessionPtr CreateSession(VFSURL* url);
   void ClearOutIdleSessions();
+  void RequestMaintenance();
   void DisconnectAllSessions();
+  void Shutdown();
+
+  static uint32_t HashIdentity(const VFSURL* url);
+protected:
+  virtual void* Process(void);
 private:
   CSFTPSessionManager() {}
   CSFTPSessionManager& operator=(const CSFTPSessionManager&);
+  void DoMaintenance();
+
+  struct SessionEntry
+  {
+    uint32_t hash;
+    std::string username;
+    std::string password;
+    std::string hostname;
+    unsigned int port;
+    CSFTPSessionPtr session; // Empty while the first caller is still connecting it
+  };
+
+  // Sessions are spread over independently locked shards by the hash of user, host and port
+  struct SessionShard
+  {
+    PLATFORM::CMutex lock;
+    PLATFORM::CCondition<bool> connected;
+    std::vector<SessionEntry> entries;
+  };
+
+  static const unsigned int SESSION_SHARDS = 16;
+
+  static SessionEntry* FindEntry(SessionShard& shard, uint32_t hash, const VFSURL* url);
+
+  SessionShard m_shards[SESSION_SHARDS];
   PLATFORM::CMutex m_lock;
-  std::map<std::string, CSFTPSessionPtr> sessions;
+  PLATFORM::CEvent m_wakeup;
+  std::vector<CSFTPSessionPtr> m_retired;
 };
@@ -0,0 +1,246 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "SFTPTrace.h"
+#include <stdlib.h>
+#include "libXBMC_addon.h"
+
+#ifdef TARGET_WINDOWS
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+extern ADDON::CHelper_libXBMC_addon* XBMC;
+
+// Events are collected in memory and written out in batches of about this size
+#define SFTP_TRACE_FLUSH_SIZE (64 * 1024)
+
+bool CSFTPTrace::m_enabled = false;
+
+CSFTPTrace& CSFTPTrace::Get()
+{
+  static CSFTPTrace instance;
+
+  return instance;
+}
+
+CSFTPTrace::CSFTPTrace()
+  : m_file(NULL)
+{
+}
+
+CSFTPTrace::~CSFTPTrace()
+{
+  Close();
+}
+
+/*!
+ \brief Returns a monotonic timestamp in microseconds.
+ */
+int64_t CSFTPTrace::Now()
+{
+#ifdef TARGET_WINDOWS
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return counter.QuadPart / frequency.QuadPart * 1000000 +
+         counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+static unsigned long GetProcessId()
+{
+#ifdef TARGET_WINDOWS
+  return GetCurrentProcessId();
+#else
+  return (unsigned long)getpid();
+#endif
+}
+
+static unsigned long GetThreadId()
+{
+#ifdef TARGET_WINDOWS
+  return GetCurrentThreadId();
+#else
+  return (unsigned long)pthread_self();
+#endif
+}
+
+/*!
+ \brief Starts tracing if SFTP_TRACE_ENV names a file that can be written.
+ */
+void CSFTPTrace::Open()
+{
+  const char *path = getenv(SFTP_TRACE_ENV);
+  if (!path || !*path)
+    return;
+
+  PLATFORM::CLockObject lock(m_lock);
+  if (m_file)
+    return;
+
+  m_file = fopen(path, "w");
+  if (!m_file)
+  {
+    XBMC->Log(ADDON::LOG_ERROR, "SFTPTrace: Failed to open trace file '%s'", path);
+    return;
+  }
+
+  XBMC->Log(ADDON::LOG_NOTICE, "SFTPTrace: Tracing SFTP operations to '%s'", path);
+  m_buffer.reserve(SFTP_TRACE_FLUSH_SIZE * 2);
+  m_buffer = "[\n";
+  AppendHeader("process_name", 'M', 0);
+  m_buffer += ",\"args\":{\"name\":\"vfs.sftp\"}},\n";
+  m_enabled = true;
+}
+
+/*!
+ \brief Stops tracing and completes the trace file.
+ */
+void CSFTPTrace::Close()
+{
+  PLATFORM::CLockObject lock(m_lock);
+  if (!m_file)
+    return;
+
+  m_enabled = false;
+
+  // The viewers accept the trailing separator, the closing bracket makes it strict JSON
+  m_buffer += "{}]\n";
+  Flush();
+  fclose(m_file);
+  m_file = NULL;
+}
+
+/*!
+ \brief Records a lifecycle event without duration.
+ */
+void CSFTPTrace::Instant(const char *name, const char *path)
+{
+  if (!m_enabled)
+    return;
+
+  int64_t now = Now();
+  PLATFORM::CLockObject lock(m_lock);
+  if (!m_file)
+    return;
+
+  AppendHeader(name, 'i', now);
+  m_buffer += ",\"s\":\"t\",\"args\":{";
+  if (path)
+  {
+    m_buffer += "\"path\":";
+    AppendString(path);
+  }
+  m_buffer += "}},\n";
+
+  if (m_buffer.size() >= SFTP_TRACE_FLUSH_SIZE)
+    Flush();
+}
+
+/*!
+ \brief Records a span, attributes with negative values (or a NULL \e path) are left out.
+ */
+void CSFTPTrace::Complete(const char *name, int64_t start, int64_t duration,
+                          const char *path, int64_t bytes, int id, int64_t lockWait)
+{
+  PLATFORM::CLockObject lock(m_lock);
+  if (!m_file)
+    return;
+
+  char number[64];
+  AppendHeader(name, 'X', start);
+  snprintf(number, sizeof(number), ",\"dur\":%lld,\"args\":{\"lock_wait_us\":%lld", (long long)duration, (long long)lockWait);
+  m_buffer += number;
+  if (path)
+  {
+    m_buffer += ",\"path\":";
+    AppendString(path);
+  }
+  if (bytes >= 0)
+  {
+    snprintf(number, sizeof(number), ",\"bytes\":%lld", (long long)bytes);
+    m_buffer += number;
+  }
+  if (id >= 0)
+  {
+    snprintf(number, sizeof(number), ",\"request_id\":%d", id);
+    m_buffer += number;
+  }
+  m_buffer += "}},\n";
+
+  if (m_buffer.size() >= SFTP_TRACE_FLUSH_SIZE)
+    Flush();
+}
+
+/*!
+ \brief Appends the fields every event has, leaving the event object open, must be called with m_lock held.
+ */
+void CSFTPTrace::AppendHeader(const char *name, char phase, int64_t timestamp)
+{
+  char header[128];
+  m_buffer += "{\"name\":";
+  AppendString(name);
+  snprintf(header, sizeof(header), ",\"cat\":\"sftp\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":%lu,\"tid\":%lu",
+           phase, (long long)timestamp, GetProcessId(), GetThreadId());
+  m_buffer += header;
+}
+
+void CSFTPTrace::AppendString(const char *value)
+{
+  m_buffer += '"';
+  for (const char *c = value; *c; c++)
+  {
+    switch (*c)
+    {
+      case '"':
+        m_buffer += "\\\"";
+        break;
+      case '\\':
+        m_buffer += "\\\\";
+        break;
+      default:
+        if ((unsigned char)*c < 0x20)
+        {
+          char escaped[8];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*c);
+          m_buffer += escaped;
+        }
+        else
+          m_buffer += *c;
+    }
+  }
+  m_buffer += '"';
+}
+
+void CSFTPTrace::Flush()
+{
+  if (!m_buffer.empty())
+    fwrite(m_buffer.data(), 1, m_buffer.size(), m_file);
+  fflush(m_file);
+  m_buffer.clear();
+}
@@ -0,0 +1,103 @@
+/*
+ *      Copyright (C) 2005-2013 Team XBMC
+ *      http://xbmc.org
+ *
+ *  This Program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This Program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with XBMC; see the file COPYING.  If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "platform/threads/mutex.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+// Environment variable naming the file a trace is written to, tracing is off if it isn't set
+#define SFTP_TRACE_ENV "KODI_SFTP_TRACE"
+
+/*!
+ \brief Writes spans of SFTP operations in the Chrome trace event format.
+
+ The file loads in chrome://tracing and the Perfetto UI. Tracing is switched on
+ by setting SFTP_TRACE_ENV to a file path before the add-on is loaded; while it
+ is off a span costs one branch and no allocation.
+ */
+class CSFTPTrace
+{
+public:
+  static CSFTPTrace& Get();
+  static bool IsEnabled() { return m_enabled; }
+  static int64_t Now();
+
+  void Open();
+  void Close();
+  void Instant(const char *name, const char *path);
+  void Complete(const char *name, int64_t start, int64_t duration,
+                const char *path, int64_t bytes, int id, int64_t lockWait);
+private:
+  CSFTPTrace();
+  ~CSFTPTrace();
+  CSFTPTrace& operator=(const CSFTPTrace&);
+  void AppendHeader(const char *name, char phase, int64_t timestamp);
+  void AppendString(const char *value);
+  void Flush();
+
+  static bool m_enabled;
+  PLATFORM::CMutex m_lock;
+  FILE *m_file;
+  std::string m_buffer;
+};
+
+/*!
+ \brief Traces the scope it lives in as one span, attributes are only recorded while tracing is on.
+
+ \e path must stay valid for the lifetime of the span.
+ */
+class CSFTPTraceSpan
+{
+public:
+  explicit CSFTPTraceSpan(const char *name)
+    : m_name(name),
+      m_path(NULL),
+      m_bytes(-1),
+      m_id(-1),
+      m_lockWait(0),
+      m_start(CSFTPTrace::IsEnabled() ? CSFTPTrace::Now() : -1)
+  {
+  }
+
+  ~CSFTPTraceSpan()
+  {
+    if (m_start >= 0)
+      CSFTPTrace::Get().Complete(m_name, m_start, CSFTPTrace::Now() - m_start, m_path, m_bytes, m_id, m_lockWait);
+  }
+
+  bool IsActive() const { return m_start >= 0; }
+  void SetPath(const char *path) { m_path = path; }
+  void SetBytes(int64_t bytes) { m_bytes = bytes; }
+  void SetRequestId(int id) { m_id = id; }
+  void AddLockWait(int64_t us) { m_lockWait += us; }
+private:
+  CSFTPTraceSpan(const CSFTPTraceSpan&);
+  CSFTPTraceSpan& operator=(const CSFTPTraceSpan&);
+
+  const char *m_name;
+  const char *m_path;
+  int64_t m_bytes;
+  int m_id;
+  int64_t m_lockWait;
+  int64_t m_start;
+};